@@ -1,181 +1,1125 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
 #include "disk_emu.h"
 
 
-FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
+/*A request waiting for the disk*/
+typedef struct request
+{
+    int start_address, nblocks;
+    char *buffer;
+    int write;
+    long long deadline; /*Microseconds on the monotonic clock*/
+    int ret, done;
+    pthread_cond_t wake;    /*Served, or the dispatching is this one's turn*/
+    struct request *next;
+} request;
 
-/*----------------------------------------------------------*/
-/*Close the disk file filled when you don't need it anymore. */
-/*----------------------------------------------------------*/
-int close_disk()
+/*State of one emulated disk*/
+struct disk
 {
-    if(NULL != fp)
+    FILE* fp[DISK_MAX_MEMBERS];
+    double L, p;
+    int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+
+    /*Blocks are striped across the member image files, stripe blocks at */
+    /*a time, so block b is in stripe unit b/stripe on member unit%members*/
+    int members;
+    int stripe;
+    int member_blocks;  /*Blocks each member file has room for*/
+
+    /*CRC32C of every block, kept past the last block of the first member */
+    /*and followed by a state word. 0 means the checksum is not known.    */
+    uint32_t *sums;
+    int CHECKSUMS;
+    int sums_dirty;     /*Table in memory is newer than the one on disk*/
+    int sums_clean;     /*State word on disk says the table can be trusted*/
+    pthread_mutex_t sums_lock;  /*Reads, writes and discards may come from several threads*/
+
+    /*Asynchronous discards: blocks queued for the discard thread, one bit */
+    /*each, and the run it is punching. A write takes its blocks out of   */
+    /*the queue, and waits if the thread is punching any of them. A read  */
+    /*waits until the thread has punched any of its blocks still queued.  */
+    int async_discard;
+    pthread_t discarder;
+    pthread_mutex_t discard_lock;
+    pthread_cond_t discard_cond;
+    unsigned char *discard_queue;
+    int discard_queued;
+    int busy_start, busy_blocks;
+
+    /*Reads and writes wait in the queue for whichever caller is         */
+    /*dispatching. It serves them in block order from where the last one */
+    /*ended, wrapping around at the end, unless one is past its deadline,*/
+    /*and merges the ones that carry on from each other into one transfer*/
+    pthread_mutex_t queue_lock;
+    request *queue;
+    int dispatching;
+    int sweep;
+    int read_expire, write_expire;  /*Default deadlines in ms*/
+    disk_trace_fn trace;    /*Told of each transfer, see disk_set_trace*/
+    void *trace_arg;
+
+    /*Seek model: crossing a whole member takes seek_time microseconds, */
+    /*and each member's head rests past the last block it moved          */
+    int seek_time;
+    int head[DISK_MAX_MEMBERS];
+
+    /*Direct I/O: each member opened a second time with O_DIRECT, and    */
+    /*aligned block buffers for it, kept for reuse once member_io is done*/
+    int direct;
+    int direct_fd[DISK_MAX_MEMBERS];
+    pthread_mutex_t pool_lock;
+    void *pool[DISK_MAX_MEMBERS];
+    int pooled;
+};
+
+/*Disk behind the calls that don't name one*/
+static disk_t *disk = NULL;
+
+/*Whether disks opened from now on checksum their blocks*/
+static int CHECKSUMS = 1;
+
+#define SUMS_CLEAN 0x43524333
+
+/*Default deadlines of reads and writes in ms*/
+#define READ_EXPIRE 50
+#define WRITE_EXPIRE 500
+
+/*Longest run of blocks requests are merged into*/
+#define MERGE_MAX 64
+
+/*Alignment of the buffers direct I/O goes through*/
+#define DIRECT_ALIGN 4096
+
+/*Deadline of the requests this thread makes in ms, -1 for the disk's*/
+static __thread int thread_deadline = -1;
+
+/*-------------------------------------------------------------------*/
+/*CRC32C (Castagnoli), with the SSE4.2 crc32 instruction where the   */
+/*CPU has it and a table otherwise                                   */
+/*-------------------------------------------------------------------*/
+static uint32_t crc_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    while (len--)
+        crc = crc_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    for (; len >= 8; len -= 8, buf += 8)
+    {
+        uint64_t w;
+        memcpy(&w, buf, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, w);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *buf++);
+    return crc;
+}
+#endif
+
+static uint32_t (*crc32c_fn)(uint32_t, const unsigned char *, size_t);
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init()
+{
+    uint32_t crc;
+    int i, k;
+
+    for (i = 0; i < 256; i++)
     {
-        fclose(fp);
+        crc = i;
+        for (k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        crc_table[i] = crc;
     }
+    crc32c_fn = crc32c_sw;
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_fn = crc32c_hw;
+#endif
+}
+
+static uint32_t block_sum(disk_t *d, const void *block)
+{
+    uint32_t crc;
+
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc32c_fn(~0u, block, d->BLOCK_SIZE);
+    /*0 is reserved for "not known"*/
+    return crc ? crc : 1;
+}
+
+static off_t sums_offset(disk_t *d)
+{
+    return (off_t)d->member_blocks * d->BLOCK_SIZE;
+}
+
+/*Finds the member holding block, and where in that member it is*/
+static int locate(disk_t *d, int block, off_t *offset)
+{
+    int unit = block / d->stripe;
+
+    *offset = ((off_t)(unit / d->members) * d->stripe + block % d->stripe) * d->BLOCK_SIZE;
+    return unit % d->members;
+}
+
+/*Loads the checksum table, trusting it only if it was closed cleanly*/
+static int load_sums(disk_t *d, int fresh)
+{
+    uint32_t state = 0;
+    size_t len = (size_t)d->MAX_BLOCK * sizeof(uint32_t);
+
+    d->sums = calloc(d->MAX_BLOCK, sizeof(uint32_t));
+    if (d->sums == NULL)
+        return -1;
+
+    /*Disks from before checksums have no table and read back short*/
+    if (!fresh && pread(fileno(d->fp[0]), &state, sizeof(state), sums_offset(d) + len) != sizeof(state))
+        state = 0;
+    if (state == SUMS_CLEAN && pread(fileno(d->fp[0]), d->sums, len, sums_offset(d)) != (ssize_t)len)
+        state = 0;
+    if (state != SUMS_CLEAN)
+        memset(d->sums, 0, len);
+
+    d->sums_clean = state == SUMS_CLEAN;
+    d->sums_dirty = 0;
     return 0;
 }
 
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+/*Marks the table on disk stale before the first write that changes it*/
+static void sums_touch(disk_t *d)
 {
-    int i, j;
+    pthread_mutex_lock(&d->sums_lock);
+    if (d->sums_clean)
+    {
+        uint32_t state = 0;
+        size_t len = (size_t)d->MAX_BLOCK * sizeof(uint32_t);
+        pwrite(fileno(d->fp[0]), &state, sizeof(state), sums_offset(d) + len);
+        d->sums_clean = 0;
+    }
+    d->sums_dirty = 1;
+    pthread_mutex_unlock(&d->sums_lock);
+}
 
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
-    /*Set up failure at 10%*/
-    p = -1.f;
-    /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+/*A block's checksum, and setting it, under sums_lock*/
+static uint32_t sum_get(disk_t *d, int b)
+{
+    uint32_t sum;
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
+    pthread_mutex_lock(&d->sums_lock);
+    sum = d->sums[b];
+    pthread_mutex_unlock(&d->sums_lock);
+    return sum;
+}
 
-    /*Initializes the random number generator*/
-    srand((unsigned int)(time( 0 )) );
+static void sum_set(disk_t *d, int b, uint32_t sum)
+{
+    pthread_mutex_lock(&d->sums_lock);
+    d->sums[b] = sum;
+    pthread_mutex_unlock(&d->sums_lock);
+}
+
+/*Gives the space behind blocks back to the host by punching holes in  */
+/*the member files. The blocks read back as 0's, with no checksum.     */
+static int punch(disk_t *d, int start_address, int nblocks)
+{
+    int b, n, m, e = 0;
+    off_t offset, next;
+
+    for (b = start_address; b < start_address + nblocks; b += n)
+    {
+        /*Blocks in one stripe unit are next to each other in one member*/
+        m = locate(d, b, &offset);
+        for (n = 1; b + n < start_address + nblocks && locate(d, b + n, &next) == m
+                    && next == offset + (off_t)n * d->BLOCK_SIZE; n++)
+            ;
+        /*Cleared first, so a read racing the punch never checks 0's against*/
+        /*the old checksum                                                   */
+        pthread_mutex_lock(&d->sums_lock);
+        memset(&d->sums[b], 0, n * sizeof(uint32_t));
+        pthread_mutex_unlock(&d->sums_lock);
+        if (fallocate(fileno(d->fp[m]), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      offset, (off_t)n * d->BLOCK_SIZE) != 0)
+            e = -1;
+    }
+    return e;
+}
+
+#define QUEUED(d, b) ((d)->discard_queue[(b) / 8] & 1 << (b) % 8)
+
+/*Punches the queued blocks a run at a time until told to stop*/
+static void *discard_thread(void *arg)
+{
+    disk_t *d = arg;
+    int b = 0, n;
+
+    pthread_mutex_lock(&d->discard_lock);
+    while (d->async_discard || d->discard_queued > 0)
+    {
+        if (d->discard_queued == 0)
+        {
+            pthread_cond_wait(&d->discard_cond, &d->discard_lock);
+            continue;
+        }
+        while (!QUEUED(d, b))
+            b = (b + 1) % d->MAX_BLOCK;
+        for (n = 0; b + n < d->MAX_BLOCK && QUEUED(d, b + n); n++)
+            d->discard_queue[(b + n) / 8] &= ~(1 << (b + n) % 8);
+        d->discard_queued -= n;
+        d->busy_start = b;
+        d->busy_blocks = n;
+
+        pthread_mutex_unlock(&d->discard_lock);
+        punch(d, b, n);
+        pthread_mutex_lock(&d->discard_lock);
+
+        d->busy_blocks = 0;
+        pthread_cond_broadcast(&d->discard_cond);
+    }
+    pthread_mutex_unlock(&d->discard_lock);
+    return NULL;
+}
+
+/*Takes the blocks of a read or write out of the discard queue, and   */
+/*waits out a punch under way on any of them                          */
+static void discard_cancel(disk_t *d, int start_address, int nblocks)
+{
+    int b;
+
+    pthread_mutex_lock(&d->discard_lock);
+    for (b = start_address; d->discard_queued > 0 && b < start_address + nblocks; b++)
+    {
+        if (QUEUED(d, b))
+        {
+            d->discard_queue[b / 8] &= ~(1 << b % 8);
+            d->discard_queued--;
+        }
+    }
+    while (d->busy_blocks > 0 && d->busy_start < start_address + nblocks
+           && start_address < d->busy_start + d->busy_blocks)
+        pthread_cond_wait(&d->discard_cond, &d->discard_lock);
+    pthread_mutex_unlock(&d->discard_lock);
+}
+
+/*Waits until the discard thread has punched whichever blocks of a read */
+/*are queued or being punched, so the hole is still made but the read   */
+/*finds each block and its checksum from one side of it                 */
+static void discard_wait(disk_t *d, int start_address, int nblocks)
+{
+    int b = start_address;
+
+    pthread_mutex_lock(&d->discard_lock);
+    while (b < start_address + nblocks)
+    {
+        if ((d->discard_queued > 0 && QUEUED(d, b))
+            || (d->busy_blocks > 0 && d->busy_start <= b && b < d->busy_start + d->busy_blocks))
+            pthread_cond_wait(&d->discard_cond, &d->discard_lock);
+        else
+            b++;
+    }
+    pthread_mutex_unlock(&d->discard_lock);
+}
 
-    /*Creates a new file*/
-    fp = fopen (filename, "w+b");
+/*Waits for the discard thread to empty its queue*/
+static void discard_drain(disk_t *d)
+{
+    pthread_mutex_lock(&d->discard_lock);
+    while (d->discard_queued > 0 || d->busy_blocks > 0)
+        pthread_cond_wait(&d->discard_cond, &d->discard_lock);
+    pthread_mutex_unlock(&d->discard_lock);
+}
 
-    if (fp == NULL)
+/*-------------------------------------------------------------------*/
+/*Tells the disk a series of blocks no longer holds anything useful. */
+/*They read back as 0's, and the host can reuse the space they took. */
+/*-------------------------------------------------------------------*/
+int disk_discard(disk_t *d, int start_address, int nblocks)
+{
+    int b;
+
+    if (d == NULL || start_address < 0 || start_address + nblocks > d->MAX_BLOCK)
     {
-        printf("Could not create new disk file %s\n\n", filename);
+        printf("out of bound error\n");
         return -1;
     }
+    if (nblocks <= 0)
+        return 0;
 
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    sums_touch(d);
+    if (!d->async_discard)
+        return punch(d, start_address, nblocks);
+
+    pthread_mutex_lock(&d->discard_lock);
+    for (b = start_address; b < start_address + nblocks; b++)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
+        if (!QUEUED(d, b))
         {
-            fputc(0, fp);
+            d->discard_queue[b / 8] |= 1 << b % 8;
+            d->discard_queued++;
         }
     }
+    pthread_cond_broadcast(&d->discard_cond);
+    pthread_mutex_unlock(&d->discard_lock);
     return 0;
 }
-/*----------------------------*/
-/*Initializes an existing disk*/
-/*----------------------------*/
-int init_disk(char *filename, int block_size, int num_blocks)
+
+/*--------------------------------------------------------------------*/
+/*Turns asynchronous discards on or off, returning the previous       */
+/*setting. While on, disk_discard returns at once and a thread of the */
+/*disk's own punches the blocks out.                                  */
+/*--------------------------------------------------------------------*/
+int disk_set_async_discard(disk_t *d, int enable)
 {
+    int was = d->async_discard;
+
+    if (enable && !was)
+    {
+        if (d->discard_queue == NULL)
+            d->discard_queue = calloc((d->MAX_BLOCK + 7) / 8, 1);
+        if (d->discard_queue == NULL)
+            return was;
+        d->async_discard = 1;
+        if (pthread_create(&d->discarder, NULL, discard_thread, d) != 0)
+            d->async_discard = 0;
+    }
+    else if (!enable && was)
+    {
+        /*The thread finishes the queue before it stops*/
+        pthread_mutex_lock(&d->discard_lock);
+        d->async_discard = 0;
+        pthread_cond_broadcast(&d->discard_cond);
+        pthread_mutex_unlock(&d->discard_lock);
+        pthread_join(d->discarder, NULL);
+    }
+    return was;
+}
+
+/*---------------------------------------------------------*/
+/*Writes the checksum table back and marks it trustworthy  */
+/*---------------------------------------------------------*/
+int disk_sync(disk_t *d)
+{
+    uint32_t state = SUMS_CLEAN;
+    size_t len;
+
+    if (d == NULL)
+        return -1;
+    if (d->async_discard)
+        discard_drain(d);
+    if (!d->sums_dirty && d->sums_clean)
+        return 0;
+
+    len = (size_t)d->MAX_BLOCK * sizeof(uint32_t);
+    pthread_mutex_lock(&d->sums_lock);
+    if (pwrite(fileno(d->fp[0]), d->sums, len, sums_offset(d)) != (ssize_t)len
+        || pwrite(fileno(d->fp[0]), &state, sizeof(state), sums_offset(d) + len) != sizeof(state))
+    {
+        pthread_mutex_unlock(&d->sums_lock);
+        return -1;
+    }
+    pthread_mutex_unlock(&d->sums_lock);
+    d->sums_dirty = 0;
+    d->sums_clean = 1;
+    return 0;
+}
+
+/*--------------------------------------------------------------------*/
+/*Turns checksumming on or off, returning the previous setting. While */
+/*off, blocks written lose their checksum rather than keep a stale one*/
+/*--------------------------------------------------------------------*/
+int disk_set_checksums(disk_t *d, int enable)
+{
+    int was = d->CHECKSUMS;
+    d->CHECKSUMS = enable;
+    return was;
+}
+
+/*--------------------------------------------------------------------*/
+/*Turns direct I/O on or off, returning the previous setting. While  */
+/*on, blocks move between the image and aligned buffers of the disk's */
+/*own without passing through the host's page cache, so what is       */
+/*cached is up to the caller. Returns -1, leaving the disk as it was, */
+/*where the host can't open the image that way. Not to be changed     */
+/*while a read or write is in progress.                               */
+/*--------------------------------------------------------------------*/
+int disk_set_direct(disk_t *d, int enable)
+{
+    int was = d->direct, m;
+    char path[64];
+
+    if (enable && !was)
+    {
+        for (m = 0; m < d->members; m++)
+        {
+            sprintf(path, "/proc/self/fd/%d", fileno(d->fp[m]));
+            d->direct_fd[m] = open(path, O_RDWR | O_DIRECT);
+            if (d->direct_fd[m] < 0)
+            {
+                while (m-- > 0)
+                    close(d->direct_fd[m]);
+                return -1;
+            }
+        }
+        d->direct = 1;
+    }
+    else if (!enable && was)
+    {
+        d->direct = 0;
+        for (m = 0; m < d->members; m++)
+            close(d->direct_fd[m]);
+    }
+    return was;
+}
+
+/*An aligned block buffer for direct I/O, NULL if none can be had*/
+static char *pool_get(disk_t *d)
+{
+    void *buf = NULL;
+
+    pthread_mutex_lock(&d->pool_lock);
+    if (d->pooled > 0)
+        buf = d->pool[--d->pooled];
+    pthread_mutex_unlock(&d->pool_lock);
+    if (buf == NULL && posix_memalign(&buf, DIRECT_ALIGN, d->BLOCK_SIZE) != 0)
+        buf = NULL;
+    return buf;
+}
+
+static void pool_put(disk_t *d, char *buf)
+{
+    pthread_mutex_lock(&d->pool_lock);
+    if (d->pooled < DISK_MAX_MEMBERS)
+    {
+        d->pool[d->pooled++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&d->pool_lock);
+    free(buf);
+}
+
+/*----------------------------------------------------------*/
+/*Close the disk file filled when you don't need it anymore. */
+/*----------------------------------------------------------*/
+int disk_close(disk_t *d)
+{
+    if(NULL != d)
+    {
+        int m;
+
+        disk_set_async_discard(d, 0);
+        disk_set_direct(d, 0);
+        disk_sync(d);
+        for (m = 0; m < d->members; m++)
+            fclose(d->fp[m]);
+        while (d->pooled > 0)
+            free(d->pool[--d->pooled]);
+        free(d->sums);
+        free(d->discard_queue);
+        pthread_mutex_destroy(&d->sums_lock);
+        pthread_mutex_destroy(&d->discard_lock);
+        pthread_cond_destroy(&d->discard_cond);
+        pthread_mutex_destroy(&d->queue_lock);
+        pthread_mutex_destroy(&d->pool_lock);
+        free(d);
+    }
+    return 0;
+}
+
+/*Sets up the emulation parameters of a disk about to be opened*/
+static disk_t *disk_new(int members, int stripe, int block_size, int num_blocks)
+{
+    disk_t *d;
+    int units;
+
+    if (members < 1 || members > DISK_MAX_MEMBERS || stripe < 1)
+    {
+        printf("Bad disk layout: %d members with stripe %d\n\n", members, stripe);
+        return NULL;
+    }
+
+    d = calloc(1, sizeof(disk_t));
+    if (d == NULL)
+        return NULL;
+
     /*Set up latency at 0.02 second*/
-    L = 00000.f;
+    d->L = 00000.f;
     /*Set up failure at 10%*/
-    p = -1.f;
+    d->p = -1.f;
     /*Set up max retry attempts after failure to 3*/
-    MAX_RETRY = 3;
+    d->MAX_RETRY = 3;
+
+    d->BLOCK_SIZE = block_size;
+    d->MAX_BLOCK = num_blocks;
+    d->CHECKSUMS = CHECKSUMS;
+    pthread_mutex_init(&d->sums_lock, NULL);
+    pthread_mutex_init(&d->discard_lock, NULL);
+    pthread_cond_init(&d->discard_cond, NULL);
+    pthread_mutex_init(&d->queue_lock, NULL);
+    pthread_mutex_init(&d->pool_lock, NULL);
+    d->read_expire = READ_EXPIRE;
+    d->write_expire = WRITE_EXPIRE;
 
-    BLOCK_SIZE = block_size;
-    MAX_BLOCK = num_blocks;
+    /*A single member holds the blocks in order, as an unstriped disk does*/
+    d->members = members;
+    d->stripe = members == 1 ? num_blocks : stripe;
+    units = (num_blocks + d->stripe - 1) / d->stripe;
+    d->member_blocks = (units + members - 1) / members * d->stripe;
 
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
+    return d;
+}
+
+/*Closes the first members of a disk that failed to open*/
+static disk_t *disk_abandon(disk_t *d, int members)
+{
+    while (members-- > 0)
+        fclose(d->fp[members]);
+    free(d);
+    return NULL;
+}
+
+/*-------------------------------------------------------------------*/
+/*Initializes a disk striped across the given files, filled with 0's */
+/*-------------------------------------------------------------------*/
+disk_t *disk_create_striped(const char **filenames, int members, int stripe,
+                            int block_size, int num_blocks)
+{
+    disk_t *d = disk_new(members, stripe, block_size, num_blocks);
+    off_t size;
+    int m;
 
-    /*Opens a file*/
-    fp = fopen (filename, "r+b");
+    if (d == NULL)
+        return NULL;
 
-    if (fp == NULL)
+    for (m = 0; m < members; m++)
     {
-        printf("Could not open %s\n\n", filename);
-        return -1;
+        /*Creates a new file*/
+        d->fp[m] = fopen (filenames[m], "w+b");
+
+        if (d->fp[m] == NULL)
+        {
+            printf("Could not create new disk file %s\n\n", filenames[m]);
+            return disk_abandon(d, m);
+        }
+
+        /*Sizes the file without writing it; the host reads back holes as 0's.*/
+        /*The checksum table and its state word follow the first member.     */
+        size = sums_offset(d);
+        if (m == 0)
+            size += (off_t)(d->MAX_BLOCK + 1) * sizeof(uint32_t);
+        if (ftruncate(fileno(d->fp[m]), size) != 0)
+        {
+            printf("Could not size disk file %s\n\n", filenames[m]);
+            return disk_abandon(d, m + 1);
+        }
     }
-    return 0;
+
+    if (load_sums(d, 1) != 0)
+        return disk_abandon(d, members);
+    return d;
 }
 
-/*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
-/*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+/*--------------------------------------------------------------------*/
+/*Initializes an existing striped disk. The files must be given in the */
+/*same order and with the same stripe as when the disk was created.    */
+/*--------------------------------------------------------------------*/
+disk_t *disk_open_striped(const char **filenames, int members, int stripe,
+                          int block_size, int num_blocks)
 {
-    int i, j, e, s;
-    e = 0;
-    s = 0;
+    disk_t *d = disk_new(members, stripe, block_size, num_blocks);
+    int m;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
+    if (d == NULL)
+        return NULL;
 
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    for (m = 0; m < members; m++)
     {
-        printf("out of bound error\n");
-        return -1;
+        /*Opens a file*/
+        d->fp[m] = fopen (filenames[m], "r+b");
+
+        if (d->fp[m] == NULL)
+        {
+            printf("Could not open %s\n\n", filenames[m]);
+            return disk_abandon(d, m);
+        }
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    if (load_sums(d, 0) != 0)
+        return disk_abandon(d, members);
+    return d;
+}
+
+/*---------------------------------------*/
+/*Initializes a disk file filled with 0's*/
+/*---------------------------------------*/
+disk_t *disk_create(const char *filename, int block_size, int num_blocks)
+{
+    return disk_create_striped(&filename, 1, 1, block_size, num_blocks);
+}
+
+/*----------------------------*/
+/*Initializes an existing disk*/
+/*----------------------------*/
+disk_t *disk_open(const char *filename, int block_size, int num_blocks)
+{
+    return disk_open_striped(&filename, 1, 1, block_size, num_blocks);
+}
+
+/*The part of a request that falls on one member*/
+typedef struct transfer
+{
+    disk_t *d;
+    int member;
+    int start_address, nblocks;
+    char *buffer;
+    int write;
+    int e, s;   /*Failures and successes, as counted by disk_read*/
+} transfer;
+
+/*Time the head of member m takes to reach the block at offset, in us*/
+static double seek_delay(disk_t *d, int m, off_t offset)
+{
+    int pos = offset / d->BLOCK_SIZE, dist = abs(pos - d->head[m]);
+
+    d->head[m] = pos + 1;
+    if (dist == 0)
+        return 0;
+    return d->seek_time * (0.1 + 0.9 * dist / d->member_blocks);
+}
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+/*Moves one block between buf and member m, going through the aligned */
+/*buffer direct when there is one. Offsets or sizes the host can't take */
+/*directly go through its page cache instead.                           */
+static int block_io(disk_t *d, int m, char *buf, char *direct, off_t offset, int write)
+{
+    ssize_t n;
+
+    if (direct != NULL)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        if (write)
+            memcpy(direct, buf, d->BLOCK_SIZE);
+        n = write ? pwrite(d->direct_fd[m], direct, d->BLOCK_SIZE, offset)
+                  : pread(d->direct_fd[m], direct, d->BLOCK_SIZE, offset);
+        if (n == d->BLOCK_SIZE && !write)
+            memcpy(buf, direct, d->BLOCK_SIZE);
+        if (n != -1 || errno != EINVAL)
+            return n == d->BLOCK_SIZE ? 0 : -1;
+    }
 
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
+    /*Straight from or into the caller's buffer, bypassing stdio's buffer*/
+    n = write ? pwrite(fileno(d->fp[m]), buf, d->BLOCK_SIZE, offset)
+              : pread(fileno(d->fp[m]), buf, d->BLOCK_SIZE, offset);
+    return n == d->BLOCK_SIZE ? 0 : -1;
+}
+
+/*Moves the blocks of a request that are on t->member, one after the other*/
+static void *member_io(void *arg)
+{
+    transfer *t = arg;
+    disk_t *d = t->d;
+    int i, b;
+    off_t offset;
+    double delay;
+    uint32_t sum;
+    char *buf, *direct = d->direct ? pool_get(d) : NULL;
 
-        for (j = 0; j < BLOCK_SIZE; j++)
+    for (i = 0; i < t->nblocks; ++i)
+    {
+        b = t->start_address + i;
+        if (locate(d, b, &offset) != t->member)
+            continue;
+        buf = t->buffer + (size_t)i * d->BLOCK_SIZE;
+
+        /*Pause until the latency duration and any seek have elapsed*/
+        delay = d->L + seek_delay(d, t->member, offset);
+        if (delay > 0)
+            usleep(delay);
+
+        if (t->write)
         {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);
+            if (block_io(d, t->member, buf, direct, offset, 1) != 0)
+            {
+                /*What reached the disk is unknown*/
+                sum_set(d, b, 0);
+                t->e--;
+                continue;
+            }
+            sum_set(d, b, d->CHECKSUMS ? block_sum(d, buf) : 0);
         }
+        else
+        {
+            if (block_io(d, t->member, buf, direct, offset, 0) != 0)
+            {
+                t->e--;
+                continue;
+            }
+
+            /*A block whose contents don't match its checksum is a failure too,*/
+            /*retried and then reported by disk_read's return value           */
+            sum = d->CHECKSUMS ? sum_get(d, b) : 0;
+            if (sum != 0 && block_sum(d, buf) != sum)
+            {
+                t->e--;
+                continue;
+            }
+        }
+        t->s++;
     }
+    if (direct != NULL)
+        pool_put(d, direct);
+    return NULL;
+}
 
-    free(blockRead);
+/*Splits a request between the members its blocks are on, and has each  */
+/*member do its part on its own thread so their latencies overlap      */
+static int transfer_blocks(disk_t *d, int start_address, int nblocks, void *buffer, int write)
+{
+    transfer t[DISK_MAX_MEMBERS];
+    pthread_t thread[DISK_MAX_MEMBERS];
+    int started[DISK_MAX_MEMBERS];
+    int first, units, parts, i, e = 0, s = 0;
 
+    first = start_address / d->stripe;
+    units = nblocks > 0 ? (start_address + nblocks - 1) / d->stripe - first + 1 : 0;
+    parts = units < d->members ? units : d->members;
+
+    for (i = 0; i < parts; i++)
+    {
+        t[i].d = d;
+        t[i].member = (first + i) % d->members;
+        t[i].start_address = start_address;
+        t[i].nblocks = nblocks;
+        t[i].buffer = buffer;
+        t[i].write = write;
+        t[i].e = t[i].s = 0;
+        /*The caller's thread does the first part itself*/
+        started[i] = i > 0 && pthread_create(&thread[i], NULL, member_io, &t[i]) == 0;
+    }
+    for (i = 0; i < parts; i++)
+    {
+        if (started[i])
+            pthread_join(thread[i], NULL);
+        else
+            member_io(&t[i]);
+        e += t[i].e;
+        s += t[i].s;
+    }
 
-    /*If no failure return the number of blocks read, else return the negative number of failures*/
+    /*If no failure return the number of blocks moved, else return the negative number of failures*/
     if (e == 0)
         return s;
     else
         return e;
 }
 
-/*------------------------------------------------------------------*/
-/*Writes a series of blocks to the disk from the buffer             */
-/*------------------------------------------------------------------*/
-int write_blocks(int start_address, int nblocks, void *buffer)
+static long long now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*How far the sweep has to go from where it is to reach a request*/
+#define AHEAD(d, r) (((r)->start_address - (d)->sweep + (d)->MAX_BLOCK) % (d)->MAX_BLOCK)
+
+static void unqueue(disk_t *d, request *r)
+{
+    request **p = &d->queue;
+
+    while (*p != r)
+        p = &(*p)->next;
+    *p = r->next;
+}
+
+/*Serves the next requests in the queue, with queue_lock held: the most */
+/*overdue if any is past its deadline, else the next one in the sweep,  */
+/*along with any that carry on from it the same way. The lock is let go */
+/*while the disk is busy.                                               */
+static void dispatch(disk_t *d)
+{
+    request *batch[MERGE_MAX], *first = NULL, *r;
+    long long now = now_us();
+    int n = 0, blocks, at, i, overdue, merged = 0;
+    char *bounce;
+    disk_trace_fn trace = d->trace;
+    void *trace_arg = d->trace_arg;
+
+    for (r = d->queue; r != NULL; r = r->next)
+    {
+        if (r->deadline <= now && (first == NULL || r->deadline < first->deadline))
+            first = r;
+    }
+    overdue = first != NULL;
+    for (r = d->queue; !overdue && r != NULL; r = r->next)
+    {
+        if (first == NULL || AHEAD(d, r) < AHEAD(d, first))
+            first = r;
+    }
+
+    unqueue(d, first);
+    batch[n++] = first;
+    blocks = first->nblocks;
+    for (r = d->queue; r != NULL && n < MERGE_MAX; )
+    {
+        if (r->write == first->write && r->start_address == first->start_address + blocks
+            && blocks + r->nblocks <= MERGE_MAX)
+        {
+            unqueue(d, r);
+            batch[n++] = r;
+            blocks += r->nblocks;
+            r = d->queue;   /*Something earlier may carry on from this one*/
+        }
+        else
+            r = r->next;
+    }
+    d->sweep = (first->start_address + blocks) % d->MAX_BLOCK;
+    pthread_mutex_unlock(&d->queue_lock);
+
+    if (trace != NULL)
+        trace(trace_arg, first->start_address, blocks, first->write);
+
+    bounce = n > 1 ? malloc((size_t)blocks * d->BLOCK_SIZE) : NULL;
+    if (bounce != NULL)
+    {
+        for (i = 0, at = 0; first->write && i < n; at += batch[i++]->nblocks)
+            memcpy(bounce + (size_t)at * d->BLOCK_SIZE, batch[i]->buffer,
+                   (size_t)batch[i]->nblocks * d->BLOCK_SIZE);
+        merged = transfer_blocks(d, first->start_address, blocks, bounce, first->write) == blocks;
+        for (i = 0, at = 0; merged && i < n; at += batch[i++]->nblocks)
+        {
+            if (!first->write)
+                memcpy(batch[i]->buffer, bounce + (size_t)at * d->BLOCK_SIZE,
+                       (size_t)batch[i]->nblocks * d->BLOCK_SIZE);
+            batch[i]->ret = batch[i]->nblocks;
+        }
+        free(bounce);
+    }
+
+    /*Requests on their own, or merged ones that failed so each gets its own result*/
+    for (i = 0; !merged && i < n; i++)
+        batch[i]->ret = transfer_blocks(d, batch[i]->start_address, batch[i]->nblocks,
+                                        batch[i]->buffer, batch[i]->write);
+
+    pthread_mutex_lock(&d->queue_lock);
+    for (i = 0; i < n; i++)
+    {
+        batch[i]->done = 1;
+        pthread_cond_signal(&batch[i]->wake);
+    }
+}
+
+/*Queues a request and waits until it has been served, dispatching the */
+/*queue itself while nobody else is. Whoever dispatches hands over to  */
+/*the next in the queue once its own request is done.                  */
+static int submit(disk_t *d, int start_address, int nblocks, void *buffer, int write)
 {
-    int i, e, s;
-    e = 0;
-    s = 0;
+    request r = {.start_address = start_address, .nblocks = nblocks,
+                 .buffer = buffer, .write = write};
+    int expire = thread_deadline >= 0 ? thread_deadline
+               : write ? d->write_expire : d->read_expire;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
+    r.deadline = now_us() + expire * 1000LL;
+    pthread_cond_init(&r.wake, NULL);
+    pthread_mutex_lock(&d->queue_lock);
+    r.next = d->queue;
+    d->queue = &r;
+    while (d->dispatching && !r.done)
+        pthread_cond_wait(&r.wake, &d->queue_lock);
+    if (!r.done)
+    {
+        d->dispatching = 1;
+        while (!r.done)
+            dispatch(d);
+        d->dispatching = 0;
+        if (d->queue != NULL)
+            pthread_cond_signal(&d->queue->wake);
+    }
+    pthread_mutex_unlock(&d->queue_lock);
+    pthread_cond_destroy(&r.wake);
+    return r.ret;
+}
 
+/*--------------------------------------------------------------------*/
+/*Sets how long the head takes to cross the whole disk, in            */
+/*microseconds, returning the previous setting. Shorter seeks take    */
+/*less, down to a tenth of it; carrying on where the last request     */
+/*ended takes none.                                                   */
+/*--------------------------------------------------------------------*/
+int disk_set_seek_time(disk_t *d, int usec)
+{
+    int was = d->seek_time;
+    d->seek_time = usec;
+    return was;
+}
+
+/*--------------------------------------------------------------------*/
+/*Sets how long reads and writes may wait in the queue, in ms, before */
+/*they are served ahead of the ones the sweep comes to first          */
+/*--------------------------------------------------------------------*/
+int disk_set_deadlines(disk_t *d, int read_ms, int write_ms)
+{
+    if (d == NULL || read_ms < 0 || write_ms < 0)
+        return -1;
+    pthread_mutex_lock(&d->queue_lock);
+    d->read_expire = read_ms;
+    d->write_expire = write_ms;
+    pthread_mutex_unlock(&d->queue_lock);
+    return 0;
+}
+
+/*--------------------------------------------------------------------*/
+/*Has fn called with each transfer the disk is about to make, once the*/
+/*requests in it are off the queue, or stops with fn NULL. It runs on */
+/*the thread dispatching, and the next transfer waits for it.         */
+/*--------------------------------------------------------------------*/
+int disk_set_trace(disk_t *d, disk_trace_fn fn, void *arg)
+{
+    if (d == NULL)
+        return -1;
+    pthread_mutex_lock(&d->queue_lock);
+    d->trace = fn;
+    d->trace_arg = arg;
+    pthread_mutex_unlock(&d->queue_lock);
+    return 0;
+}
+
+/*--------------------------------------------------------------------*/
+/*Returns the number of requests waiting in the queue                 */
+/*--------------------------------------------------------------------*/
+int disk_queued(disk_t *d)
+{
+    request *r;
+    int n = 0;
+
+    if (d == NULL)
+        return -1;
+    pthread_mutex_lock(&d->queue_lock);
+    for (r = d->queue; r != NULL; r = r->next)
+        n++;
+    pthread_mutex_unlock(&d->queue_lock);
+    return n;
+}
+
+/*--------------------------------------------------------------------*/
+/*Sets the deadline in ms of the requests the calling thread makes    */
+/*from now on, on any disk, returning the previous setting. -1 goes   */
+/*back to each disk's deadlines for reads and writes.                 */
+/*--------------------------------------------------------------------*/
+int disk_set_thread_deadline(int ms)
+{
+    int was = thread_deadline;
+    thread_deadline = ms < 0 ? -1 : ms;
+    return was;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int disk_read(disk_t *d, int start_address, int nblocks, void *buffer)
+{
     /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    if (d == NULL || start_address + nblocks > d->MAX_BLOCK)
     {
         printf("out of bound error\n");
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    if (d->async_discard)
+        discard_wait(d, start_address, nblocks);
+
+    return submit(d, start_address, nblocks, buffer, 0);
+}
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+/*------------------------------------------------------------------*/
+/*Writes a series of blocks to the disk from the buffer             */
+/*------------------------------------------------------------------*/
+int disk_write(disk_t *d, int start_address, int nblocks, void *buffer)
+{
+    /*Checks that the data requested is within the range of addresses of the disk*/
+    if (d == NULL || start_address + nblocks > d->MAX_BLOCK)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        printf("out of bound error\n");
+        return -1;
+    }
 
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+    sums_touch(d);
+    if (d->async_discard)
+        discard_cancel(d, start_address, nblocks);
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
-    }
-    free(blockWrite);
+    return submit(d, start_address, nblocks, buffer, 1);
+}
 
-    /*If no failure return the number of blocks written, else return the negative number of failures*/
-    if (e == 0)
-        return s;
-    else
-        return e;
+/*-------------------------------------------------------------*/
+/*The original interface, working on one disk at a time         */
+/*-------------------------------------------------------------*/
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
+    close_disk();
+    disk = disk_create(filename, block_size, num_blocks);
+    return disk ? 0 : -1;
+}
+
+int init_disk(char *filename, int block_size, int num_blocks)
+{
+    close_disk();
+    disk = disk_open(filename, block_size, num_blocks);
+    return disk ? 0 : -1;
+}
+
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_read(disk, start_address, nblocks, buffer);
+}
+
+int write_blocks(int start_address, int nblocks, void *buffer)
+{
+    return disk_write(disk, start_address, nblocks, buffer);
+}
+
+int discard_blocks(int start_address, int nblocks)
+{
+    return disk_discard(disk, start_address, nblocks);
+}
+
+int sync_disk()
+{
+    return disk_sync(disk);
+}
+
+int close_disk()
+{
+    disk_close(disk);
+    disk = NULL;
+    return 0;
+}
+
+/*Sets checksumming for the current disk and any opened later*/
+int disk_checksums(int enable)
+{
+    int was = CHECKSUMS;
+    CHECKSUMS = enable;
+    if (disk != NULL)
+        disk_set_checksums(disk, enable);
+    return was;
 }
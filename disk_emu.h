@@ -1,5 +1,36 @@
+typedef struct disk disk_t;
+
+/*Called with each transfer a disk makes, see disk_set_trace*/
+typedef void (*disk_trace_fn)(void *arg, int start_address, int nblocks, int write);
+
+/*Most image files a disk can be striped across*/
+#define DISK_MAX_MEMBERS 16
+
+disk_t *disk_create(const char *filename, int block_size, int num_blocks);
+disk_t *disk_open(const char *filename, int block_size, int num_blocks);
+disk_t *disk_create_striped(const char **filenames, int members, int stripe,
+                            int block_size, int num_blocks);
+disk_t *disk_open_striped(const char **filenames, int members, int stripe,
+                          int block_size, int num_blocks);
+int disk_read(disk_t *d, int start_address, int nblocks, void *buffer);
+int disk_write(disk_t *d, int start_address, int nblocks, void *buffer);
+int disk_sync(disk_t *d);
+int disk_close(disk_t *d);
+int disk_set_checksums(disk_t *d, int enable);
+int disk_discard(disk_t *d, int start_address, int nblocks);
+int disk_set_async_discard(disk_t *d, int enable);
+int disk_set_seek_time(disk_t *d, int usec);
+int disk_set_deadlines(disk_t *d, int read_ms, int write_ms);
+int disk_set_thread_deadline(int ms);
+int disk_set_trace(disk_t *d, disk_trace_fn fn, void *arg);
+int disk_queued(disk_t *d);
+int disk_set_direct(disk_t *d, int enable);
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int discard_blocks(int start_address, int nblocks);
 int close_disk();
+int sync_disk();
+int disk_checksums(int enable);
@@ -1,10 +1,17 @@
 #include "sfs_api.h"
 #include "disk_emu.h"
+#include "sfs_lz.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <time.h>
 /************************************************
 ECSE 427 / COMP 310 - Operating Systems
 SCOTT COOPER
@@ -18,505 +25,3790 @@ Programming Assignment 2 - Simple File System
 #define SUPERBLOCK 0
 #define FREE_LIST 1
 #define ROOT_LOC 2
-#define ROOT_SIZE 20
+#define ROOT_SIZE 128      // 2048 entries of 128 bytes
 #define FAT_LOC ROOT_LOC+ROOT_SIZE
-#define FAT_SIZE 4
-#define DATA_START FAT_LOC+FAT_SIZE
+#define FAT_SIZE 16        // FAT_ENTRIES entries of 4 bytes
+#define REF_LOC FAT_LOC+FAT_SIZE
+#define REF_SIZE 8         // one block_ref per data block
+#define DATA_START REF_LOC+REF_SIZE
 // block size in bytes
 #define BLOCKSIZE 2048
 
-// super + free sector list + root + FAT_LOC
-#define NUMBLOCKS 1+BLOCKSIZE+ROOT_SIZE+FAT_SIZE
+// super + free sector list + root + FAT_LOC + refs + data
+#define NUMBLOCKS 2+ROOT_SIZE+FAT_SIZE+REF_SIZE+BLOCKSIZE
+
+// Compressed and deduplicated files can hold more blocks than the disk,
+// so the FAT has more entries than there are data blocks. Entry
+// BLOCKSIZE doubles as the end of chain marker and is never handed out.
+#define FAT_ENTRIES (4*BLOCKSIZE)
+
+// Data index of a FAT entry that is part of a chain but whose block
+// data_put has not picked yet. Unlike BLOCKSIZE it doesn't mark the entry free.
+#define DATA_PENDING (BLOCKSIZE+1)
+
+// Data index of a FAT entry in a hole of a sparse file. It reads as zeros
+// and only gets a block of its own once something is written there.
+#define DATA_HOLE (BLOCKSIZE+2)
+
+// Buckets of the in-memory fingerprint index on dedup volumes
+#define DEDUP_BUCKETS 4096
+
+// On compressed volumes a data block is split into FRAGS fragments, and a
+// compressed block occupies a run of them. The free list block holds one
+// nibble of fragment usage per data block starting at byte FRAG_MAP.
+#define FRAG_SIZE 512
+#define FRAGS (BLOCKSIZE/FRAG_SIZE)
+#define FRAG_MAP 1024
 
 // Assume at most 12 characters for filename
 #define MAX_FNAME_LENGTH 12
 
+// Files up to this size live in their directory entry and own no blocks
+#define INLINE_MAX 108
+
 // filename for file system
 #define FILENAME "my.sfs"
 
+// Identifies a super block written by this implementation. The on disk
+// format is laid out so that an all-zero image is an empty file system.
+#define SFS_MAGIC 0x53465335
+
+// Number of block-sized pages of metadata and data kept resident at once
+#define CACHE_PAGES 64
+
+// Write-back: the flusher starts on the dirty blocks once there are
+// WB_BACKGROUND of them or the oldest has waited WB_EXPIRE milliseconds.
+// Writers only wait for it with WB_LIMIT blocks not yet on disk.
+#define WB_BACKGROUND 256
+#define WB_LIMIT 1024
+#define WB_EXPIRE 50
+#define WB_BUCKETS 1024
+
+// Most blocks the flusher writes in one request
+#define WB_RUN 32
+
+// Log volumes append data a segment at a time. A segment is the 32 data
+// blocks of one free list word. The cleaner starts emptying segments once
+// fewer than LOG_RESERVE are clean, moving LOG_CLEAN_STEP live blocks for
+// every block written.
+#define LOG_SEGMENT 32
+#define LOG_SEGMENTS (BLOCKSIZE / LOG_SEGMENT)
+#define LOG_RESERVE 4
+#define LOG_CLEAN_STEP 2
+
+// Pages that views may never pin, so lookups always find a victim
+#define CACHE_RESERVE 8
+
+// The blocks in the cache at a clean unmount are listed in the super
+// block from word HOT_LIST on, a count and then the block numbers, and
+// read back in the background after the next mount. Those reads may wait
+// WARM_DEADLINE ms behind the caller's own.
+#define HOT_LIST 16
+#define HOT_MAX CACHE_PAGES
+#define WARM_DEADLINE 1000
+
+// States of a block on the warm list
+#define WARM_PENDING 0
+#define WARM_READY 1
+#define WARM_GONE 2
+
 typedef struct directory_entry {
     char name[MAX_FNAME_LENGTH + 1];
-    unsigned short indx;
+    unsigned char type;     // TYPE_FILE or TYPE_DIR
+    unsigned short indx;    // first FAT entry, BLOCKSIZE if stored inline
     unsigned int size;
+    char data[INLINE_MAX];  // contents of an inline file, zero past size
 } directory_entry;
 
 typedef struct FAT_entry {
     unsigned short data;
     unsigned short next;
+    unsigned char frag;     // first fragment of a compressed block
+    unsigned char nfrag;    // fragments used; FRAGS (or 0) for a whole block
 } FAT_entry;
 
+// Per data block reference count and content fingerprint. A zeroed entry
+// is a block with at most one owner whose contents aren't indexed.
+typedef struct block_ref {
+    unsigned int hash;      // fingerprint of the contents, 0 if unknown
+    unsigned int refs;      // owners beyond the first
+} block_ref;
+
+// A file ID handed out by sfs_fopen. Descriptors live in one slab, and
+// the free ones are chained through next, so opening and closing never
+// search or allocate once the slab has grown to the number of files open.
 typedef struct file_descriptor {
     unsigned int read_ptr;
     unsigned int write_ptr;
-    unsigned int size;
-    unsigned short start;
+    int file;               // open_file slot, NO_FILE while free
+    int next;               // next free descriptor, -1 terminated
 } file_descriptor;
 
-int filesOpen;
-directory_entry *root_directory;
-file_descriptor **file_descriptor_table;
-FAT_entry *FAT;
+// What is known about a file while it's in use, shared by its descriptor
+// and any regions mapped from it. Slots are kept in their own slab, on a
+// free list or on a hash chain keyed by directory and name.
+typedef struct open_file {
+    unsigned int size;
+    unsigned short start;
+    unsigned short parent;  // directory holding the file, ROOT_DIR for the root
+    unsigned short slot;    // root directory entry of the file
+    unsigned short refs;    // its descriptor, if open, and each mapping
+    int fd;                 // descriptor sfs_fopen hands out, -1 if closed
+    int next;               // hash chain, or free list, -1 terminated
+    char name[MAX_FNAME_LENGTH + 1];
+} open_file;
+
+#define NO_FILE -1
+
+// Descriptors and open files each slab has room for at mount
+#define SLAB_START 64
+
+// Buckets of the open file hash table
+#define FILE_BUCKETS 256
+
+typedef struct mapping {
+    char *addr;             // start of the region handed to the caller
+    int length;             // bytes of file mapped
+    int offset;             // file offset of addr[0]
+    int file;               // open file the region is written back to
+    int flags;              // SFS_MAP_READ and/or SFS_MAP_WRITE
+    struct mapping *next;
+} mapping;
+
+typedef struct cache_page {
+    int block;          // disk block held by this page, -1 if empty
+    int pins;           // views referencing this page; never evicted while > 0
+    unsigned int used;  // LRU stamp, higher = more recently used
+    char data[BLOCKSIZE];
+} cache_page;
+
+// A block written by the file system but not yet on disk
+typedef struct wb_block {
+    int block;
+    int writing;        // in the batch the flusher is writing out
+    int next;           // hash chain, or free list, -1 terminated
+    char data[BLOCKSIZE];
+} wb_block;
+
+// Everything known about one mounted volume
+struct sfs {
+    disk_t *disk;
+
+    // Descriptor slab and its free list
+    file_descriptor *fds;
+    int nfds, free_fd;
+
+    // Open file slab, its free list and the hash table over the slots in use
+    open_file *files;
+    int nfiles, free_file;
+    int file_hash[FILE_BUCKETS];
+
+    // Metadata and data are paged in on demand rather than read whole at mount
+    cache_page *cache;
+    unsigned int cache_clock;
+    int cache_pinned;   // pages with pins > 0
+
+    // Root directory slots at or above dir_hwm have never been used
+    int dir_hwm;
+
+    // Format options (SFS_COMPRESS) recorded in the super block
+    int sfs_flags;
+
+    // Last compressed block expanded, kept so small sequential reads of the
+    // same block decompress it once
+    char lz_buf[BLOCKSIZE];
+    int lz_block, lz_frag;
+
+    // Data block most recently used for fragments, tried first to keep a
+    // file's compressed blocks together
+    int frag_hint;
+
+    // FAT entry fat_free_entry starts its next search from
+    int fat_hint;
+
+    // Regions handed out by sfs_mmap
+    mapping *maps;
+
+    // Progress of the defragmenter, so each sfs_defrag call picks up where
+    // the last one stopped: the FAT entry the next file in this pass starts
+    // at, and how much of it has been moved to the run starting at defrag_run
+    int defrag_start, defrag_pos, defrag_run;
+
+    // Blocks moved by the current sfs_defrag call, and its limit (0 for none)
+    int defrag_moved, defrag_limit;
+
+    // Log volumes: the segment being appended to and the next block in it,
+    // and the segment being cleaned. Segments the cleaner couldn't empty
+    // are left out until it runs out of others. log_owner is the FAT entry
+    // that last took each data block, found at mount and kept up by
+    // fat_set; the cleaner checks it against the FAT before trusting it.
+    int log_seg, log_head;
+    int log_victim;
+    unsigned long long log_skip;
+    unsigned short log_owner[BLOCKSIZE];
+
+    // Fingerprint index of a dedup volume: data blocks chained by hash bucket,
+    // BLOCKSIZE terminated. Rebuilt from the block_ref table at mount.
+    unsigned short dedup_head[DEDUP_BUCKETS];
+    unsigned short dedup_next[BLOCKSIZE];
+
+    // Set when a block could not be read back intact (a failed read or a
+    // checksum mismatch); callers clear it before the reads they care about
+    int io_error;
+
+    // Whether blocks bypass the host's page cache: mounted with SFS_DIRECT,
+    // on a host that can do it
+    int direct;
+
+    // Whether fsck_pass prints what it finds
+    int fsck_verbose;
+
+    // Data blocks freed since the last discard_flush, one bit each
+    unsigned int discard[BLOCKSIZE / 32];
+
+    // Write-back buffer, shared with the flusher thread under wb_lock.
+    // Blocks are found through wb_hash, newest first, so a block written
+    // again while the flusher has it gets a new entry ahead of the old.
+    pthread_t flusher;
+    pthread_mutex_t wb_lock;
+    pthread_cond_t wb_wake;     // flusher: work to do, or time to stop
+    pthread_cond_t wb_done;     // everyone else: a batch reached the disk
+    wb_block *wb;
+    int wb_free;
+    int wb_hash[WB_BUCKETS];
+    int wb_dirty;               // entries not yet picked up by the flusher
+    int wb_batch;               // entries the flusher is writing out
+    long long wb_oldest;        // when the oldest dirty entry was written
+    int wb_syncs;               // callers waiting for everything to be written
+    int wb_stop;
+    int wb_error;               // a batch failed to reach the disk, not yet reported
+    char wb_run[WB_RUN * BLOCKSIZE];    // flusher: neighbours merged into one write
+
+    // Blocks that were hot at the last unmount, in block order, read by
+    // the warm thread and shared with it under wb_lock. Each is used at
+    // most once: taken by a cache miss, or dropped when it is written.
+    pthread_t warmer;
+    int warm_n;
+    int warm_left;              // not yet taken or dropped
+    int warm_hits;              // cache misses served from them
+    int warm_block[HOT_MAX];
+    char warm_state[HOT_MAX];
+    char (*warm_data)[BLOCKSIZE];
+};
+
+// Volume the current call works on. Each sfs_*_r entry point sets it from
+// its handle so the internals don't have to pass it around; a handle must
+// only be used by one thread at a time, but different handles can be used
+// from different threads at once.
+static __thread sfs_t *fs;
+
+// Volume used by the original calls, opened by mksfs
+static sfs_t *default_fs;
+
+// Written in place of the gap when a file is extended past its end
+static const char zero_block[BLOCKSIZE];
 
 int first_open();
+static int free_blocks();
+static void dedup_load();
+static int fd_grow();
+static int file_grow();
 void set_used(unsigned short indx);
 void set_unused(unsigned short indx);
+static void discard_flush();
+static int free_run(int n);
+static int log_alloc();
+static void log_load();
+static void log_clean(int max);
+static void warm_drop(int block);
+
+/*
+ * Writes go to the write-back buffer and return; a thread per volume puts
+ * them on disk later, in block order and several blocks to a request.
+ * Reads look in the buffer before going to the disk.
+ */
+
+static long long now_ms(){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-int mksfs(int fresh){
-    if (fresh){
-        // Check if file system currently exists, and delete it if it does
-        if( access( FILENAME, F_OK ) != -1 ) {
-            unlink(FILENAME);}
+// Newest entry for block, or -1. Called with wb_lock held.
+static int wb_find(int block){
+    int k;
 
-        // Create a new disk
-        if (init_fresh_disk(FILENAME, BLOCKSIZE, NUMBLOCKS)!=0){
-            fprintf(stderr, "Cannot create fresh filesystem");
-            return -1;
+    for (k = fs->wb_hash[block % WB_BUCKETS]; k != -1; k = fs->wb[k].next){
+        if (fs->wb[k].block == block)
+            return k;}
+    return -1;
+}
+
+static int wb_cmp(const void *a, const void *b){
+    return fs->wb[*(const int *) a].block - fs->wb[*(const int *) b].block;
+}
+
+// Write the batch out in block order, merging neighbours into one request.
+// Returns -1 if any of it didn't reach the disk.
+static int wb_write(int *batch, int n){
+    char *run = fs->wb_run;
+    int i, len, err = 0;
+
+    qsort(batch, n, sizeof(int), wb_cmp);
+    for (i = 0; i < n; i += len){
+        for (len = 1; i + len < n && len < WB_RUN
+                      && fs->wb[batch[i + len]].block == fs->wb[batch[i]].block + len; len++)
+            memcpy(run + len * BLOCKSIZE, fs->wb[batch[i + len]].data, BLOCKSIZE);
+        if (len == 1){
+            if (disk_write(fs->disk, fs->wb[batch[i]].block, 1, fs->wb[batch[i]].data) != 1)
+                err = -1;
+        } else {
+            memcpy(run, fs->wb[batch[i]].data, BLOCKSIZE);
+            if (disk_write(fs->disk, fs->wb[batch[i]].block, len, run) != len)
+                err = -1;}
+    }
+    return err;
+}
+
+static void *flusher(void *arg){
+    int batch[WB_LIMIT];
+    int n, b, k, *p, err;
+
+    fs = arg;
+    pthread_mutex_lock(&fs->wb_lock);
+    while (!fs->wb_stop || fs->wb_dirty > 0){
+        if (fs->wb_dirty == 0 || (!fs->wb_stop && !fs->wb_syncs && fs->wb_dirty < WB_BACKGROUND
+                                  && now_ms() - fs->wb_oldest < WB_EXPIRE)){
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += WB_EXPIRE / 2 * 1000000;
+            if (ts.tv_nsec >= 1000000000){
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;}
+            pthread_cond_timedwait(&fs->wb_wake, &fs->wb_lock, &ts);
+            continue;
         }
 
-        // Create super block
-        int *super_buff = malloc(BLOCKSIZE);
+        // Take everything dirty. Until it is on disk it stays findable,
+        // and writes to the same blocks go to new entries.
+        for (n = 0, b = 0; b < WB_BUCKETS; b++){
+            for (k = fs->wb_hash[b]; k != -1; k = fs->wb[k].next){
+                if (!fs->wb[k].writing){
+                    fs->wb[k].writing = 1;
+                    batch[n++] = k;}
+            }
+        }
+        fs->wb_dirty = 0;
+        fs->wb_batch = n;
+        pthread_mutex_unlock(&fs->wb_lock);
+
+        err = wb_write(batch, n);
+
+        pthread_mutex_lock(&fs->wb_lock);
+        if (err)
+            fs->wb_error = 1;
+        for (b = 0; b < WB_BUCKETS; b++){
+            for (p = &fs->wb_hash[b]; *p != -1;){
+                k = *p;
+                if (!fs->wb[k].writing){
+                    p = &fs->wb[k].next;
+                    continue;}
+                *p = fs->wb[k].next;
+                fs->wb[k].next = fs->wb_free;
+                fs->wb_free = k;
+            }
+        }
+        fs->wb_batch = 0;
+        pthread_cond_broadcast(&fs->wb_done);
+    }
+    pthread_mutex_unlock(&fs->wb_lock);
+    return NULL;
+}
 
-        if (!super_buff){
-            fprintf(stderr, "Error creating super block");
-            return -1;}
+// Queue a copy of buf to be written to block. Only waits when the buffer
+// is full.
+static void block_write(int block, const char *buf){
+    int k;
+
+    pthread_mutex_lock(&fs->wb_lock);
+    k = wb_find(block);
+    if (k == -1 || fs->wb[k].writing){
+        while (fs->wb_free == -1){
+            pthread_cond_signal(&fs->wb_wake);
+            pthread_cond_wait(&fs->wb_done, &fs->wb_lock);
+        }
+        k = fs->wb_free;
+        fs->wb_free = fs->wb[k].next;
+        fs->wb[k].block = block;
+        fs->wb[k].writing = 0;
+        fs->wb[k].next = fs->wb_hash[block % WB_BUCKETS];
+        fs->wb_hash[block % WB_BUCKETS] = k;
+        if (fs->wb_dirty++ == 0)
+            fs->wb_oldest = now_ms();
+        if (fs->wb_dirty == WB_BACKGROUND)
+            pthread_cond_signal(&fs->wb_wake);
+    }
+    memcpy(fs->wb[k].data, buf, BLOCKSIZE);
+    if (fs->warm_left > 0)
+        warm_drop(block);
+    pthread_mutex_unlock(&fs->wb_lock);
+}
 
-        super_buff[0] = BLOCKSIZE;  // Size of each block
-        super_buff[1] = NUMBLOCKS;  // Number of blocks on disk (including super)
-        super_buff[1] = FREE_LIST;  // Block containing free list
-        super_buff[2] = ROOT_LOC;       // Location of 1st block of root directory
-        super_buff[4] = ROOT_SIZE;  // Number of for root directory
-        super_buff[5] = FAT_LOC;        // Location of 1st block of FAT_LOC
-        super_buff[6] = FAT_SIZE;   // Number of blocks for FAT_LOC
-        super_buff[7] = DATA_START; // Location of 1st block of user data
+// Read n blocks into buf. A single block may come from the write-back
+// buffer; a longer read of blocks that aren't all on disk yet fails, and
+// the caller goes a block at a time instead.
+static int block_read(int block, int n, char *buf){
+    int k = -1, i;
+
+    // Entries only ever move on to the disk, and only this thread adds
+    // them, so what isn't buffered now can be read from the disk
+    pthread_mutex_lock(&fs->wb_lock);
+    for (i = 0; i < n && k == -1; i++)
+        k = wb_find(block + i);
+    if (k != -1 && n == 1)
+        memcpy(buf, fs->wb[k].data, BLOCKSIZE);
+    pthread_mutex_unlock(&fs->wb_lock);
+
+    if (k != -1)
+        return n == 1 ? 1 : -1;
+    return disk_read(fs->disk, block, n, buf);
+}
 
-        write_blocks(SUPERBLOCK, 1, super_buff);
-        free(super_buff);
+// Wait until everything written so far is on disk. Returns -1 if a
+// write-back has failed since the error was last reported.
+static int wb_sync(){
+    int err;
 
-        // Create free lest
-        unsigned int *free_buff = malloc(BLOCKSIZE);
-        if (!free_buff){
-            fprintf(stderr, "Error initialize free sector list");
-            return -1;}
+    pthread_mutex_lock(&fs->wb_lock);
+    fs->wb_syncs++;
+    while (fs->wb_dirty > 0 || fs->wb_batch > 0){
+        pthread_cond_signal(&fs->wb_wake);
+        pthread_cond_wait(&fs->wb_done, &fs->wb_lock);
+    }
+    fs->wb_syncs--;
+    err = fs->wb_error ? -1 : 0;
+    pthread_mutex_unlock(&fs->wb_lock);
+    return err;
+}
 
-        int i;
+// Report a failed write-back once: returns -1 and clears it if there was one
+static int wb_failed(){
+    int err;
 
-        // Fill array with 1s to signify not used data blocks (1 = available)
-        for (i = 0; i < BLOCKSIZE/sizeof(unsigned int); i++){
-            free_buff[i] = ~0;}
+    pthread_mutex_lock(&fs->wb_lock);
+    err = fs->wb_error ? -1 : 0;
+    fs->wb_error = 0;
+    pthread_mutex_unlock(&fs->wb_lock);
+    return err;
+}
 
-        write_blocks(FREE_LIST, 1, free_buff);
-        free(free_buff);
+// Drop what is buffered for n blocks about to be discarded, waiting out
+// any the flusher is writing so it can't land after the discard
+static void wb_forget(int block, int n){
+    int i, k, *p;
+
+    pthread_mutex_lock(&fs->wb_lock);
+    for (i = 0; i < n; i++){
+        for (p = &fs->wb_hash[(block + i) % WB_BUCKETS]; (k = *p) != -1;){
+            if (fs->wb[k].block != block + i){
+                p = &fs->wb[k].next;
+            } else if (fs->wb[k].writing){
+                pthread_cond_wait(&fs->wb_done, &fs->wb_lock);
+                p = &fs->wb_hash[(block + i) % WB_BUCKETS];
+            } else {
+                *p = fs->wb[k].next;
+                fs->wb[k].next = fs->wb_free;
+                fs->wb_free = k;
+                fs->wb_dirty--;}
+        }
+    }
+    pthread_mutex_unlock(&fs->wb_lock);
+}
 
-        // Create root directory
-        directory_entry *new_root_buff = malloc(BLOCKSIZE*sizeof(directory_entry));
+// Set up the write-back buffer and start the flusher
+static int wb_start(){
+    int k;
+    pthread_condattr_t attr;
 
-        if (!new_root_buff){
-            fprintf(stderr, "Error initializing root directory");
-            return -1;}
+    fs->wb = malloc(WB_LIMIT * sizeof(wb_block));
+    if (!fs->wb)
+        return -1;
+    fs->wb_free = -1;
+    for (k = WB_LIMIT - 1; k >= 0; k--){
+        fs->wb[k].next = fs->wb_free;
+        fs->wb_free = k;}
+    memset(fs->wb_hash, -1, sizeof(fs->wb_hash));
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&fs->wb_lock, NULL);
+    pthread_cond_init(&fs->wb_wake, &attr);
+    pthread_cond_init(&fs->wb_done, NULL);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&fs->flusher, NULL, flusher, fs) != 0){
+        free(fs->wb);
+        return -1;}
+    return 0;
+}
 
-        for (i = 0; i < BLOCKSIZE*ROOT_SIZE/sizeof(directory_entry); i++)
-            new_root_buff[i] = (directory_entry) {.name = "\0", .size=0, .indx = BLOCKSIZE };
+// Write out everything left and stop the flusher. Returns -1 if anything
+// failed to reach the disk and hasn't been reported yet.
+static int wb_stop(){
+    pthread_mutex_lock(&fs->wb_lock);
+    fs->wb_stop = 1;
+    pthread_cond_signal(&fs->wb_wake);
+    pthread_mutex_unlock(&fs->wb_lock);
+    pthread_join(fs->flusher, NULL);
+
+    pthread_mutex_destroy(&fs->wb_lock);
+    pthread_cond_destroy(&fs->wb_wake);
+    pthread_cond_destroy(&fs->wb_done);
+    free(fs->wb);
+    return fs->wb_error ? -1 : 0;
+}
 
-        write_blocks(ROOT_LOC, ROOT_SIZE, new_root_buff);
-        free(new_root_buff);
+/*
+ * Warm restarts: the blocks that were cached at the last unmount are read
+ * back after mount, a run of neighbours at a time, into a staging area
+ * of their own rather than the cache. A cache miss takes its block from
+ * there if it has arrived; the cache itself is only filled on demand.
+ */
+
+// Entry for block on the warm list, or -1. Called with wb_lock held.
+static int warm_find(int block){
+    int lo = 0, hi = fs->warm_n - 1;
+
+    while (lo <= hi){
+        int mid = (lo + hi) / 2;
+        if (fs->warm_block[mid] == block)
+            return mid;
+        if (fs->warm_block[mid] < block)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
 
-        // Create File Allocation Table
-        FAT_entry *new_fat_table = malloc(BLOCKSIZE * sizeof(FAT_entry));
+// Forget block on the warm list, as what was read for it is stale or
+// about to be. Called with wb_lock held.
+static void warm_drop(int block){
+    int k = warm_find(block);
 
-        if (!new_fat_table){
-            fprintf(stderr, "Error intitializing FAT_LOC");
-            return -1;}
+    if (k != -1 && fs->warm_state[k] != WARM_GONE){
+        fs->warm_state[k] = WARM_GONE;
+        fs->warm_left--;}
+}
 
-        for (i = 0; i < BLOCKSIZE; i++){
-            new_fat_table[i].data = BLOCKSIZE;
-            new_fat_table[i].next = BLOCKSIZE;}
+// Whether the warm thread has read block and nothing has used it yet
+static int warm_has(int block){
+    int k, has;
+
+    if (fs->warm_left == 0)
+        return 0;
+    pthread_mutex_lock(&fs->wb_lock);
+    k = warm_find(block);
+    has = k != -1 && fs->warm_state[k] == WARM_READY;
+    pthread_mutex_unlock(&fs->wb_lock);
+    return has;
+}
 
-        write_blocks(FAT_LOC, FAT_SIZE, new_fat_table);
-        free(new_fat_table);
+// Copy block into buf if the warm thread has read it. Returns 1 if it did.
+static int warm_take(int block, char *buf){
+    int k, ok = 0;
+
+    pthread_mutex_lock(&fs->wb_lock);
+    k = warm_find(block);
+    if (k != -1 && fs->warm_state[k] == WARM_READY){
+        memcpy(buf, fs->warm_data[k], BLOCKSIZE);
+        fs->warm_hits++;
+        ok = 1;}
+    warm_drop(block);
+    pthread_mutex_unlock(&fs->wb_lock);
+    return ok;
+}
 
-    } else {
-        // Open disk before initialize data structures
-        if (init_disk(FILENAME, BLOCKSIZE, NUMBLOCKS) != 0){
-            fprintf(stderr, "Error in opening disk");
-            return -1;
-        }
+// Read the warm list in runs of neighbouring blocks. Blocks written while
+// a run is being read were dropped meanwhile, and stay dropped.
+static void *warmer(void *arg){
+    int i, k, len, ok;
+
+    fs = arg;
+    disk_set_thread_deadline(WARM_DEADLINE);
+    for (i = 0; i < fs->warm_n; i += len){
+        for (len = 1; i + len < fs->warm_n && fs->warm_block[i + len] == fs->warm_block[i] + len; len++)
+            ;
+        ok = disk_read(fs->disk, fs->warm_block[i], len, fs->warm_data[i]) == len;
+
+        pthread_mutex_lock(&fs->wb_lock);
+        for (k = i; k < i + len; k++){
+            if (fs->warm_state[k] == WARM_PENDING)
+                fs->warm_state[k] = ok ? WARM_READY : WARM_GONE;}
+        pthread_mutex_unlock(&fs->wb_lock);
     }
+    return NULL;
+}
 
-    int *super_block = malloc(BLOCKSIZE);
-    if (!super_block){
-        fprintf(stderr, "Error reading super block");
-        return -1;}
+static int block_cmp(const void *a, const void *b){
+    return *(const int *) a - *(const int *) b;
+}
 
-    read_blocks(SUPERBLOCK, 1, super_block);
+// Start reading back the blocks listed in the super block
+static void warm_start(const int *super_block){
+    int n = super_block[HOT_LIST], i;
 
-    // Initialize variables
-    filesOpen = 0;
+    if (n <= 0 || n > HOT_MAX)
+        return;
+    for (i = 0; i < n; i++){
+        int b = super_block[HOT_LIST + 1 + i];
+        if (b > SUPERBLOCK && b < NUMBLOCKS && (fs->warm_n == 0 || b > fs->warm_block[fs->warm_n - 1]))
+            fs->warm_block[fs->warm_n++] = b;
+    }
+    memset(fs->warm_state, WARM_PENDING, sizeof(fs->warm_state));
+    fs->warm_left = fs->warm_n;
+    fs->warm_data = malloc(fs->warm_n * BLOCKSIZE);
+
+    if (fs->warm_n == 0 || !fs->warm_data || pthread_create(&fs->warmer, NULL, warmer, fs) != 0){
+        free(fs->warm_data);
+        fs->warm_data = NULL;
+        fs->warm_n = fs->warm_left = 0;}
+}
+
+// Wait for the warm thread and let go of what it read
+static void warm_stop(){
+    if (!fs->warm_data)
+        return;
+    pthread_join(fs->warmer, NULL);
+    free(fs->warm_data);
+    fs->warm_data = NULL;
+    fs->warm_n = fs->warm_left = 0;
+}
 
-    root_directory = malloc(sizeof(directory_entry) * BLOCKSIZE);
-    FAT = malloc(sizeof(FAT_entry) * BLOCKSIZE);
+// Return the page holding block. On a miss the least recently used
+// unpinned page is recycled, and filled from disk only if fill is set.
+static cache_page *cache_lookup(int block, int fill){
+    int i, victim = -1;
+
+    for (i = 0; i < CACHE_PAGES; i++){
+        if (fs->cache[i].block == block){
+            fs->cache[i].used = ++fs->cache_clock;
+            return &fs->cache[i];}
+        if (fs->cache[i].pins == 0 && (victim == -1 || fs->cache[i].used < fs->cache[victim].used))
+            victim = i;
+    }
 
-    if (!root_directory || !FAT){
-        fprintf(stderr, "Error in malloc at mksfs");
-        exit(1);}
+    if (fill && !(fs->warm_left > 0 && warm_take(block, fs->cache[victim].data))
+        && block_read(block, 1, fs->cache[victim].data) < 0){
+        // Hand back what was read, but don't keep it around
+        fs->io_error = 1;
+        fs->cache[victim].block = -1;
+        fs->cache[victim].used = 0;
+        return &fs->cache[victim];}
+    fs->cache[victim].block = block;
+    fs->cache[victim].used = ++fs->cache_clock;
+    return &fs->cache[victim];
+}
 
-    read_blocks(ROOT_LOC, ROOT_SIZE, root_directory);
-    read_blocks(FAT_LOC, FAT_SIZE, FAT);
+// Whether block is held by a cache page
+static int cache_has(int block){
+    int i;
 
+    for (i = 0; i < CACHE_PAGES; i++){
+        if (fs->cache[i].block == block)
+            return 1;}
     return 0;
 }
 
-void sfs_ls(void){
-    if (!root_directory){   // Check file system is initialized
-        fprintf(stderr,
-            "Error in sfs_ls.\nFile system neads to be initialized first");
-        return;}
+static char *cache_block(int block){
+    return cache_lookup(block, 1)->data;
+}
 
-    int i;
+// Copy len bytes of metadata starting off bytes into block
+static void meta_read(int block, int off, void *dst, int len){
+    block += off / BLOCKSIZE;
+    off %= BLOCKSIZE;
+
+    while (len > 0){
+        int n = BLOCKSIZE - off < len ? BLOCKSIZE - off : len;
+        memcpy(dst, cache_block(block) + off, n);
+        dst = (char *) dst + n;
+        len -= n;
+        off = 0;
+        block++;
+    }
+}
 
-    for (i = 0; i < BLOCKSIZE; i++){        // Print out files and sizes
-        if (strncmp(root_directory[i].name, "\0", 1) != 0){
-            printf("%12s: %d\n", root_directory[i].name, root_directory[i].size);
-        }
+// Update len bytes of metadata, writing back only the blocks touched
+static void meta_write(int block, int off, const void *src, int len){
+    block += off / BLOCKSIZE;
+    off %= BLOCKSIZE;
+
+    while (len > 0){
+        int n = BLOCKSIZE - off < len ? BLOCKSIZE - off : len;
+        char *page = cache_block(block);
+        memcpy(page + off, src, n);
+        block_write(block, page);
+        src = (const char *) src + n;
+        len -= n;
+        off = 0;
+        block++;
     }
 }
 
-int sfs_fopen(char *name){
-    // Check name is valid
-    if (strlen(name) > MAX_FNAME_LENGTH)
-        return -1;
+// Block indices are stored off by one on disk so that 0, rather than
+// BLOCKSIZE, means "none" and a zeroed table needs no initialization
+static unsigned short to_disk(unsigned short indx){
+    return indx == BLOCKSIZE ? 0 : indx + 1;
+}
 
-    // Make sure file system has been initialized
-    if (!root_directory){
-        fprintf(stderr,
-            "Error in sfs_fopen.\nFile system neads to be opened first");
-        return -1;}
+static unsigned short from_disk(unsigned short indx){
+    return indx == 0 ? BLOCKSIZE : indx - 1;
+}
 
-    int i;
+static directory_entry dir_get(int i){
+    directory_entry e;
+    meta_read(ROOT_LOC, i * sizeof(directory_entry), &e, sizeof(e));
+    e.indx = from_disk(e.indx);
+    return e;
+}
 
-    // Check if file exists
-    for (i = 0; i < BLOCKSIZE; i++){
-        if (strcmp(root_directory[i].name, name) == 0){
-            int fd = -1, j;
-
-            // Make sure we haven't already opened this file.
-            // If so, return the original file descriptor
-            for (j = 0; j < filesOpen; j++){
-                if (file_descriptor_table[j] && root_directory[i].indx == file_descriptor_table[j]->start)
-                    return j;
-            }
+static void dir_set(int i, directory_entry e){
+    e.indx = to_disk(e.indx);
+    meta_write(ROOT_LOC, i * sizeof(directory_entry), &e, sizeof(e));
+}
 
-            // Otherwise, create an FD for that file, assuming we have room
-            for (j = 0; j < filesOpen; j++){
-                if (!file_descriptor_table[j]){
-                    file_descriptor_table[j] = malloc(sizeof(file_descriptor));
-                    fd = j;
-                    break;
-                }
-            }
+// On disk a FAT entry is two shorts. The data block index takes the low
+// 12 bits of the first, with the fragment run in the top 4 bits; a whole
+// block leaves them zero.
+static FAT_entry fat_decode(const unsigned short raw[2]){
+    FAT_entry e;
+
+    e.data = from_disk(raw[0] & 0xFFF);
+    e.frag = (raw[0] >> 12) & 3;
+    e.nfrag = FRAGS - (raw[0] >> 14);
+    e.next = from_disk(raw[1]);
+    return e;
+}
 
-            // If we don't have room, make room
-            if (fd == -1){
-                file_descriptor_table = realloc(file_descriptor_table, (1+filesOpen)*(sizeof(file_descriptor *)));
-                file_descriptor_table[filesOpen] = (file_descriptor *) malloc(sizeof(file_descriptor));
-                fd = filesOpen++;
-            }
+static FAT_entry fat_get(int i){
+    unsigned short raw[2];
 
-            // Initialize file descriptor with correct info
-            file_descriptor *new = file_descriptor_table[fd];
-            if (!new){
-                fprintf(stderr, "Error opening %12s", name);
-                return -1;}
+    meta_read(FAT_LOC, i * sizeof(raw), raw, sizeof(raw));
+    return fat_decode(raw);
+}
 
-            new->read_ptr = 0;
-            new->write_ptr = root_directory[i].size;
-            new->size = root_directory[i].size;
-            new->start = root_directory[i].indx;
-            return fd;
-        }
-    }
+static void fat_set(int i, FAT_entry e){
+    unsigned short raw[2];
+    int nfrag = e.nfrag ? e.nfrag : FRAGS;
 
-    // Otherwise, the file has't been created, find a space and create it
-    for (i = 0; i < BLOCKSIZE; i++){
+    raw[0] = to_disk(e.data) | e.frag << 12 | (FRAGS - nfrag) << 14;
+    raw[1] = to_disk(e.next);
+    meta_write(FAT_LOC, i * sizeof(raw), raw, sizeof(raw));
+    if ((fs->sfs_flags & SFS_LOG) && e.data < BLOCKSIZE)
+        fs->log_owner[e.data] = i;
+}
 
-        // Find an empty spot
-        if (strncmp(root_directory[i].name, "\0", 1) == 0){
+static block_ref ref_get(int b){
+    block_ref r;
+    meta_read(REF_LOC, b * sizeof(r), &r, sizeof(r));
+    return r;
+}
 
-            int fd = -1, j;
+static void ref_set(int b, block_ref r){
+    meta_write(REF_LOC, b * sizeof(r), &r, sizeof(r));
+}
 
-            // Find a location in the FD table
-            for (j = 0; j < filesOpen; j++){
-                if (file_descriptor_table[j] == NULL){
-                    file_descriptor_table[j] = malloc(sizeof(file_descriptor));
-                    fd = j;
-                    break;
-                }
-            }
+// Record that slot i of the root directory is in use, so that scans
+// after the next mount know how far to look
+static void dir_grow(int i){
+    if (i < fs->dir_hwm)
+        return;
 
-            if (fd == -1){
-                file_descriptor_table = realloc(file_descriptor_table, (1+filesOpen)*(sizeof(file_descriptor *)));
-                file_descriptor_table[filesOpen] = (file_descriptor *) malloc(sizeof(file_descriptor));
-                fd = filesOpen++;
-            }
+    int *super_block = (int *) cache_block(SUPERBLOCK);
+    fs->dir_hwm = i + 1;
+    super_block[9] = fs->dir_hwm;
+    block_write(SUPERBLOCK, (char *) super_block);
+}
 
-            file_descriptor *new = file_descriptor_table[fd];
+// List the blocks in the cache in the super block for the next mount,
+// in block order so an unchanged list isn't written again
+static void hot_save(){
+    int list[HOT_MAX], n = 0, i;
+
+    for (i = 0; i < CACHE_PAGES && n < HOT_MAX; i++){
+        if (fs->cache[i].block > SUPERBLOCK)
+            list[n++] = fs->cache[i].block;}
+    qsort(list, n, sizeof(int), block_cmp);
+
+    int *super_block = (int *) cache_block(SUPERBLOCK);
+    if (super_block[HOT_LIST] == n && !memcmp(super_block + HOT_LIST + 1, list, n * sizeof(int)))
+        return;
+    super_block[HOT_LIST] = n;
+    memcpy(super_block + HOT_LIST + 1, list, n * sizeof(int));
+    block_write(SUPERBLOCK, (char *) super_block);
+}
 
-            if (!new){
-                fprintf(stderr, "Error creating %12s", name);
-                return -1;}
+// Drop everything belonging to a mounted file system. Returns -1 if some
+// of it couldn't be written back.
+static int unmount(){
+    // Write back and release mappings while their files are tracked
+    while (fs->maps)
+        sfs_munmap_r(fs, fs->maps->addr);
+    discard_flush();
+    warm_stop();
+    hot_save();
+    int err = wb_stop();
+
+    free(fs->fds);
+    free(fs->files);
+    free(fs->cache);
+    disk_close(fs->disk);
+    return err;
+}
 
-            // Find first available FAT table entry
-            int start = -1;
+// Mount the volume in the image at path, or with SFS_FORMAT in opts
+// format a new one there with the other SFS_* options. Existing file
+// systems keep the options they were formatted with. Returns NULL if
+// the image can't be opened or created.
+sfs_t *sfs_mount(const char *path, int opts){
+    return sfs_mount_striped(&path, 1, 1, opts);
+}
 
-            for (i = 0; i < BLOCKSIZE;i++){
-                if (FAT[i].data == BLOCKSIZE){
-                    start = i;
-                    break;
-                }
-            }
+// Like sfs_mount, but the volume is striped across members images,
+// stripe blocks at a time. Large reads and writes go to all of them at
+// once. An existing volume must be given the same images, in the same
+// order and with the same stripe, as when it was formatted.
+sfs_t *sfs_mount_striped(const char **paths, int members, int stripe, int opts){
+    int flags = opts & ~(SFS_FORMAT | SFS_DISCARD_ASYNC | SFS_DIRECT), m;
+
+    if (__builtin_popcount(flags & (SFS_COMPRESS | SFS_DEDUP | SFS_LOG)) > 1){
+        fprintf(stderr, "Only one of compression, dedup and log mode can be used\n");
+        return NULL;}
+
+    sfs_t *h = calloc(1, sizeof(sfs_t));
+    if (!h){
+        fprintf(stderr, "Error in malloc at sfs_mount");
+        return NULL;}
+    fs = h;
+
+    if (opts & SFS_FORMAT){
+        // Check if file system currently exists, and delete it if it does
+        for (m = 0; m < members; m++){
+            if( access( paths[m], F_OK ) != -1 ) {
+                unlink(paths[m]);}
+        }
+
+        // Create a new disk
+        fs->disk = disk_create_striped(paths, members, stripe, BLOCKSIZE, NUMBLOCKS);
+        if (fs->disk == NULL){
+            fprintf(stderr, "Cannot create fresh filesystem");
+            free(h);
+            return NULL;
+        }
 
-            if (start == -1) return -1;
+        // Create super block
+        int *super_buff = calloc(1, BLOCKSIZE);
 
-            // Find first available place for first block of data
-            int data = first_open();
-            if (data == -1) return -1;
-            set_used(data);
+        if (!super_buff){
+            fprintf(stderr, "Error creating super block");
+            disk_close(fs->disk);
+            free(h);
+            return NULL;}
 
-            // Initialize valus
-            new->read_ptr = 0;
-            new->write_ptr = 0;
-            new->size = 0;
-            new->start = start;
+        super_buff[0] = BLOCKSIZE;  // Size of each block
+        super_buff[1] = NUMBLOCKS;  // Number of blocks on disk (including super)
+        super_buff[2] = FREE_LIST;  // Block containing free list
+        super_buff[3] = ROOT_LOC;       // Location of 1st block of root directory
+        super_buff[4] = ROOT_SIZE;  // Number of for root directory
+        super_buff[5] = FAT_LOC;        // Location of 1st block of FAT_LOC
+        super_buff[6] = FAT_SIZE;   // Number of blocks for FAT_LOC
+        super_buff[7] = DATA_START; // Location of 1st block of user data
+        super_buff[8] = SFS_MAGIC;  // Marks the fields below as valid
+        super_buff[9] = 0;          // Root directory slots in use (high water)
+        super_buff[10] = flags;     // Format options
+        super_buff[11] = REF_LOC;   // Location of 1st block of block refs
+        super_buff[12] = REF_SIZE;  // Number of blocks for block refs
 
-            strncpy(root_directory[i].name, name, 13);
-            root_directory[i].size = 0;
-            root_directory[i].indx = start;
-            write_blocks(ROOT_LOC, ROOT_SIZE, root_directory);
+        disk_write(fs->disk, SUPERBLOCK, 1, super_buff);
+        free(super_buff);
 
-            FAT[start].data = data;
-            write_blocks(FAT_LOC, FAT_SIZE, FAT);
-            return fd;
+        // The free list, root directory and FAT are all zero when empty,
+        // which the freshly sized disk already reads back as
+    } else {
+        // Open disk before initialize data structures
+        fs->disk = disk_open_striped(paths, members, stripe, BLOCKSIZE, NUMBLOCKS);
+        if (fs->disk == NULL){
+            fprintf(stderr, "Error in opening disk");
+            free(h);
+            return NULL;
         }
     }
-    return -1;
+
+    // Only the super block is read here; the root directory, FAT and
+    // free list are paged in as they are used
+    fs->cache = calloc(CACHE_PAGES, sizeof(cache_page));
+    if (!fs->cache || wb_start() == -1){
+        fprintf(stderr, "Error in malloc at sfs_mount");
+        free(fs->cache);
+        disk_close(fs->disk);
+        free(h);
+        return NULL;}
+
+    int i;
+    for (i = 0; i < CACHE_PAGES; i++)
+        fs->cache[i].block = -1;
+
+    int *super_block = (int *) cache_block(SUPERBLOCK);
+
+    if (super_block[0] != BLOCKSIZE){
+        fprintf(stderr, "Error reading super block\n");
+        wb_stop();
+        free(fs->cache);
+        disk_close(fs->disk);
+        free(h);
+        return NULL;}
+
+    // Images from before the current layout can't be read; only a
+    // reformat brings them back
+    if (super_block[8] != SFS_MAGIC){
+        fprintf(stderr, "Unsupported file system format: reformat the image\n");
+        wb_stop();
+        free(fs->cache);
+        disk_close(fs->disk);
+        free(h);
+        return NULL;}
+
+    fs->dir_hwm = super_block[9];
+    fs->sfs_flags = super_block[10];
+    fs->lz_block = -1;
+    fs->frag_hint = -1;
+    fs->log_seg = fs->log_victim = -1;
+    if (fs->sfs_flags & SFS_LOG)
+        log_load();
+
+    if (opts & SFS_DISCARD_ASYNC)
+        disk_set_async_discard(fs->disk, 1);
+    if (opts & SFS_DIRECT)
+        fs->direct = disk_set_direct(fs->disk, 1) != -1;
+
+    warm_start(super_block);
+    if (fs->sfs_flags & SFS_DEDUP)
+        dedup_load();
+
+    // Room for SLAB_START open files up front; the slabs grow on demand
+    fs->free_fd = fs->free_file = -1;
+    memset(fs->file_hash, -1, sizeof(fs->file_hash));
+    fd_grow();
+    file_grow();
+
+    return h;
 }
 
-// Make sure that the file descriptor is valid
-int sfs_fclose(int fileID){
-    // Make sure fileID is valid and fileID hasn't already been closed
-    if (fileID >= filesOpen || file_descriptor_table[fileID] == NULL)
+// Write back everything and release the volume. h is invalid afterwards.
+// Negative return value => some blocks never reached the disk.
+int sfs_unmount(sfs_t *h){
+    if (!(fs = h))
         return -1;
+    int err = unmount();
+    free(h);
+    fs = NULL;
+    return err;
+}
 
-    free(file_descriptor_table[fileID]);
-    file_descriptor_table[fileID] = NULL;
-    return 0;
+// Bucket chain of the fingerprint index that blocks hashing to h are on
+static unsigned short *dedup_bucket(unsigned int h){
+    return &fs->dedup_head[h % DEDUP_BUCKETS];
 }
 
-int sfs_fwrite(int fileID, char *buf, int length){
-    int length_orig = length;
+static void dedup_link(int b, unsigned int h){
+    unsigned short *head = dedup_bucket(h);
+    fs->dedup_next[b] = *head;
+    *head = b;
+}
 
-    // Make sure we have a valid fileID
-    if (buf == NULL || length < 0 ||
-        fileID >= filesOpen || file_descriptor_table[fileID] == NULL)
-        return -1;
+static void dedup_unlink(int b, unsigned int h){
+    unsigned short *p = dedup_bucket(h);
 
-    file_descriptor *to_write = file_descriptor_table[fileID];
+    while (*p != BLOCKSIZE && *p != b)
+        p = &fs->dedup_next[*p];
+    if (*p == b)
+        *p = fs->dedup_next[b];
+}
 
-    FAT_entry *current = &(FAT[to_write->start]);
+// Index every fingerprinted block of the mounted volume
+static void dedup_load(){
+    int b;
 
-    char *disk_buff = malloc(BLOCKSIZE);        // Buffer to read sector into
-    int i = (to_write->write_ptr) / BLOCKSIZE;  // which sector write_ptr is in
-    int j = (to_write->write_ptr) % BLOCKSIZE;  // how far into sector write_ptr is
+    for (b = 0; b < DEDUP_BUCKETS; b++)
+        fs->dedup_head[b] = BLOCKSIZE;
+    for (b = 0; b < BLOCKSIZE; b++){
+        block_ref r = ref_get(b);
+        if (r.hash)
+            dedup_link(b, r.hash);
+    }
+}
 
-    while (i > 0){  // find correct sector
-        current = &(FAT[current->next]);
-        i--;}
+// Fingerprint of a block's contents, never 0
+static unsigned int block_hash(const char *buf){
+    const unsigned int *w = (const unsigned int *) buf;
+    unsigned int h = 2166136261u;
+    int i;
 
-    i = 0;  // how many sectors we've read into buf
+    for (i = 0; i < BLOCKSIZE / sizeof(unsigned int); i++)
+        h = (h ^ w[i]) * 16777619u;
+    return h ? h : 1;
+}
 
-    int offset = 0;
-    while (length > 0){     // keep writing while there's something left to write
-        read_blocks(DATA_START + current->data, 1, disk_buff);
-        memcpy(disk_buff + j, buf + offset, (BLOCKSIZE - j < length ? BLOCKSIZE - j :  length));
-        write_blocks(DATA_START + current->data, 1, disk_buff);
+// A data block already holding exactly buf, or -1
+static int dedup_find(unsigned int h, const char *buf){
+    int b;
+
+    for (b = *dedup_bucket(h); b != BLOCKSIZE; b = fs->dedup_next[b]){
+        if (ref_get(b).hash != h)
+            continue;
+        fs->io_error = 0;
+        char *page = cache_block(DATA_START + b);
+        if (!fs->io_error && memcmp(page, buf, BLOCKSIZE) == 0)
+            return b;
+    }
+    return -1;
+}
 
-        length -= (BLOCKSIZE - j);
-        offset += (BLOCKSIZE - j);
-        j = 0;
-        i++;
+// Fragments of data block b in use, one bit per fragment
+static int frag_bits(int b){
+    unsigned char *map = (unsigned char *) cache_block(FREE_LIST) + FRAG_MAP;
+    return (map[b / 2] >> (b % 2 * 4)) & 0xF;
+}
 
-        if (current->next == BLOCKSIZE && length > 0){
-            int k;
-            int found = 0;
-            for (k = 0; k < BLOCKSIZE; k++){
-                if (FAT[k].data == BLOCKSIZE){
-                    int next = first_open();
-                    if (next == -1) return -1;
-                    set_used(next);
-                    current->next = k;
-                    FAT[k].data = next;
-                    write_blocks(FAT_LOC, FAT_SIZE, FAT);
-                    found = 1;
-                    break;
-                }
-            }
-            if (!found)
-                return -1;
-        }
+static void frag_mark(int b, int bits){
+    unsigned char *map = (unsigned char *) cache_block(FREE_LIST) + FRAG_MAP;
+    map[b / 2] = (map[b / 2] & ~(0xF << (b % 2 * 4))) | bits << (b % 2 * 4);
+    block_write(FREE_LIST, (char *) map - FRAG_MAP);
+}
+
+// First run of nfrag free fragments in b, or -1
+static int frag_fit(int b, int nfrag){
+    int bits = frag_bits(b), mask = (1 << nfrag) - 1, f;
 
-        if (length > 0)
-            current = &(FAT[current->next]);
+    for (f = 0; f + nfrag <= FRAGS; f++){
+        if (!(bits & mask << f))
+            return f;
     }
+    return -1;
+}
 
-    // Increase the size of the file as necessary
-    to_write->size = to_write->write_ptr + length_orig > to_write->size
-                        ? to_write->write_ptr + length_orig
-                        : to_write->size;
+// Find room for nfrag fragments, packing them into partly used blocks
+// before starting a new one
+static int frag_alloc(int nfrag, FAT_entry *e){
+    int b = -1, f = -1, k;
 
-    // Increase the write_ptr
-    to_write->write_ptr += length_orig;
+    if (fs->frag_hint != -1 && frag_bits(fs->frag_hint) != 0)
+        f = frag_fit(b = fs->frag_hint, nfrag);
 
-    for (i = 0; i < BLOCKSIZE; i++){
-        // Increase size of root_directory entry
-        if (to_write->start == root_directory[i].indx){
-            root_directory[i].size = to_write->size;
-            write_blocks(ROOT_LOC, ROOT_SIZE, root_directory);
-            break;
-        }
+    for (k = 0; f == -1 && k < BLOCKSIZE; k++){
+        int bits = frag_bits(k);
+        if (bits != 0 && bits != 0xF)
+            f = frag_fit(b = k, nfrag);
+    }
+
+    if (f == -1){
+        b = first_open();
+        if (b == -1)
+            return -1;
+        set_used(b);
+        f = 0;
     }
 
-    free(disk_buff);
-    return length_orig;
+    frag_mark(b, frag_bits(b) | ((1 << nfrag) - 1) << f);
+    fs->frag_hint = b;
+    e->data = b;
+    e->frag = f;
+    e->nfrag = nfrag;
+    return 0;
 }
 
-// Negative return value => invalid file ID
-int sfs_fread(int fileID, char *buf, int length){
-    if (length < 0 || buf == NULL ||
-        fileID >= filesOpen || file_descriptor_table[fileID] == NULL)
-        return -1;
+static void frag_release(int b, int f, int nfrag){
+    int bits = frag_bits(b) & ~(((1 << nfrag) - 1) << f);
 
-    file_descriptor *to_read = file_descriptor_table[fileID];
+    frag_mark(b, bits);
+    if (bits == 0)
+        set_unused(b);
+}
 
-    FAT_entry *current = &(FAT[to_read->start]);
+static int is_whole(FAT_entry e){
+    return e.nfrag == 0 || e.nfrag == FRAGS;
+}
 
-    // Make sure we aren't reading past the last written byte of the file
-    if (to_read->read_ptr + length > to_read->size)
-        length = to_read->size - to_read->read_ptr;
-
-    int length_orig = length;
-    char *disk_buff = malloc(BLOCKSIZE);   // Buffer to read sector into
-    int i = (to_read->read_ptr) / BLOCKSIZE;   // which sector read ptr is in
-    int j = (to_read->read_ptr) % BLOCKSIZE; // how far into sector read_ptr is
-
-    while (i > 0){  // find correct sector
-        current = &(FAT[current->next]);
-        i--;}
-
-    int offset = 0;
-    while (length > 0){
-        read_blocks(DATA_START + current->data, 1, disk_buff);
-        memcpy(buf + offset, disk_buff + j, (BLOCKSIZE - j < length ? BLOCKSIZE - j :  length));
-        length -= (BLOCKSIZE - j);
-        offset += (BLOCKSIZE - j);
-        j = 0;
+// Whole data block that another chain also references, so it can't be
+// changed where it is
+static int is_shared(FAT_entry e){
+    return e.data < BLOCKSIZE && is_whole(e) && ref_get(e.data).refs > 0;
+}
 
-        // check if trying to read past end of file
-        if (current->next == BLOCKSIZE && length > 0){
-            return -1;}
+// Drop one owner of whole data block b, freeing it with the last
+static void block_unref(int b){
+    block_ref r = ref_get(b);
 
-        if (length > 0){
-            current = &(FAT[current->next]);}
-    }
-    free(disk_buff);
-    to_read->read_ptr += length_orig;
-    return length_orig;
+    if (r.refs){
+        r.refs--;
+        ref_set(b, r);
+        return;}
+    if (r.hash){
+        dedup_unlink(b, r.hash);
+        ref_set(b, (block_ref) {0, 0});}
+    set_unused(b);
 }
 
-// Negative return value => invalid file ID
-int sfs_fseek(int fileID, int offset){
-    if (fileID >= filesOpen || file_descriptor_table[fileID] == NULL)
-        return -1;
+// Give back the storage behind a FAT entry
+static void data_release(FAT_entry e){
+    if (e.data >= BLOCKSIZE)
+        return;
+    if (is_whole(e))
+        block_unref(e.data);
+    else
+        frag_release(e.data, e.frag, e.nfrag);
+}
 
-    file_descriptor_table[fileID]->read_ptr = offset;
-    file_descriptor_table[fileID]->write_ptr = offset;
-    return 0;
+// Contents of the data block mapped by e, expanded if it is compressed.
+// The pointer is good until the next cache or data call.
+static char *data_get(FAT_entry e){
+    if (e.data == DATA_HOLE)
+        return (char *) zero_block;
+    if (is_whole(e))
+        return cache_block(DATA_START + e.data);
+
+    if (fs->lz_block != e.data || fs->lz_frag != e.frag){
+        unsigned char *src = (unsigned char *) cache_block(DATA_START + e.data)
+                             + e.frag * FRAG_SIZE;
+        int clen = src[0] | src[1] << 8;
+
+        fs->lz_block = -1;
+        if (fs->io_error)
+            return fs->lz_buf;  // the caller gives up on this block anyway
+        if (clen > e.nfrag * FRAG_SIZE - 2
+            || lz_decompress(src + 2, clen, (unsigned char *) fs->lz_buf, BLOCKSIZE) != BLOCKSIZE){
+            fprintf(stderr, "Corrupt compressed block %d\n", e.data);
+            memset(fs->lz_buf, 0, BLOCKSIZE);
+        } else {
+            fs->lz_block = e.data;
+            fs->lz_frag = e.frag;}
+        return fs->lz_buf;
+    }
+    return fs->lz_buf;
 }
 
-// Negative return value => file not found
-int sfs_remove(char *file){
-    int i;
-    for (i = 0; i < BLOCKSIZE; i++){
-        if (strncmp(root_directory[i].name, file, 13) == 0){
-            directory_entry *to_remove = &(root_directory[i]);
-            strcpy(to_remove->name,"\0");
-            to_remove->size =0;
-            FAT_entry *fat_tr = &(FAT[to_remove->indx]);
-            to_remove->indx = BLOCKSIZE;
-
-            while (1){
-                set_unused(fat_tr->data);
-                fat_tr->data = BLOCKSIZE;
-                if (fat_tr->next == BLOCKSIZE)
-                    break;
-                FAT_entry *fat_tr_next = &(FAT[fat_tr->next]);
-                fat_tr->next = BLOCKSIZE;
-                fat_tr = fat_tr_next;
-            }
+// Number of blocks, up to max, starting with e's that are whole, stored one
+// after the other on disk in chain order and neither cached nor read back
+// by the warm thread. They can be read in one request, which a striped
+// disk splits between its members.
+static int data_run(FAT_entry e, int max){
+    int n = 0, first = e.data;
+
+    while (n < max && e.data == first + n && e.data < BLOCKSIZE && is_whole(e)
+           && !cache_has(DATA_START + e.data) && !warm_has(DATA_START + e.data)){
+        n++;
+        if (e.next == BLOCKSIZE)
+            break;
+        e = fat_get(e.next);
+    }
+    return n;
+}
 
-            write_blocks(FAT_LOC, FAT_SIZE, FAT);
+// data_put for dedup volumes. Contents already on disk are shared rather
+// than written again; otherwise buf gets a block of its own, reusing the
+// old one when nothing else references it.
+static int dedup_put(int k, FAT_entry *e, const char *buf){
+    unsigned int h = block_hash(buf);
+    int b = dedup_find(h, buf);
+    FAT_entry old = *e;
+
+    if (b != -1 && b == old.data)
+        return 0;   // unchanged
+
+    if (b != -1){
+        block_ref r = ref_get(b);
+        r.refs++;
+        ref_set(b, r);
+    } else {
+        if (old.data < BLOCKSIZE && ref_get(old.data).refs == 0){
+            // Sole owner: rewrite in place under the new fingerprint
+            b = old.data;
+            block_ref r = ref_get(b);
+            if (r.hash)
+                dedup_unlink(b, r.hash);
+        } else {
+            b = first_open();
+            if (b == -1) return -1;
+            set_used(b);}
+
+        char *page = cache_lookup(DATA_START + b, 0)->data;
+        if (page != buf)
+            memcpy(page, buf, BLOCKSIZE);
+        block_write(DATA_START + b, page);
+        ref_set(b, (block_ref) {h, 0});
+        dedup_link(b, h);
+        if (b == old.data)
             return 0;
+    }
 
-        }
+    e->data = b;
+    e->nfrag = FRAGS;
+    fat_set(k, *e);
+    data_release(old);
+    return 0;
+}
+
+// Store a block's worth of buf as the contents of FAT entry k, currently
+// mapped by *e. On compressed volumes the block is compressed and moved if
+// it no longer fits where it was; blocks that don't shrink by at least a
+// fragment are stored whole. On log volumes it always moves, to the head
+// of the log.
+static int data_put(int k, FAT_entry *e, const char *buf){
+    unsigned char out[BLOCKSIZE];
+    int nfrag = FRAGS, clen = -1;
+    FAT_entry old = *e;
+
+    if (fs->sfs_flags & SFS_DEDUP)
+        return dedup_put(k, e, buf);
+
+    if (fs->sfs_flags & SFS_COMPRESS)
+        clen = lz_compress((const unsigned char *) buf, BLOCKSIZE, out + 2,
+                           (FRAGS - 1) * FRAG_SIZE - 2);
+    if (clen != -1)
+        nfrag = (clen + 2 + FRAG_SIZE - 1) / FRAG_SIZE;
+
+    // Move to new storage unless the old storage has room and is ours
+    // alone. A whole block that can't be swapped for fragments simply
+    // stays whole. Holes have no storage yet.
+    if (old.data >= BLOCKSIZE || (fs->sfs_flags & SFS_LOG)
+        || (nfrag == FRAGS ? !is_whole(old) || is_shared(old)
+                           : is_whole(old) || old.nfrag < nfrag)){
+        if (nfrag == FRAGS){
+            int b = (fs->sfs_flags & SFS_LOG) ? log_alloc() : first_open();
+            if (b == -1) return -1;
+            set_used(b);
+            *e = (FAT_entry) {.data = b, .next = old.next, .nfrag = FRAGS};
+            data_release(old);
+        } else if (frag_alloc(nfrag, e) == 0){
+            data_release(old);
+        } else if (is_whole(old) && old.data < BLOCKSIZE){
+            nfrag = FRAGS;
+        } else {
+            return -1;}
+    } else if (nfrag < old.nfrag){
+        frag_release(old.data, old.frag + nfrag, old.nfrag - nfrag);
+        e->nfrag = nfrag;
+    }
+    if (e->data != old.data || e->frag != old.frag || e->nfrag != old.nfrag)
+        fat_set(k, *e);
+
+    if (fs->lz_block == e->data)
+        fs->lz_block = -1;
+
+    int b = DATA_START + e->data;
+    if (nfrag == FRAGS){
+        char *page = cache_lookup(b, 0)->data;
+        if (page != buf)
+            memcpy(page, buf, BLOCKSIZE);
+        block_write(b, page);
+    } else {
+        // The rest of the block belongs to other files
+        char *page = cache_block(b);
+        out[0] = clen & 0xFF;
+        out[1] = clen >> 8;
+        memcpy(page + e->frag * FRAG_SIZE, out, nfrag * FRAG_SIZE);
+        block_write(b, page);
     }
+    return 0;
+}
 
+// Find an unused FAT entry, or -1 if the table is full. The search
+// resumes after the last entry handed out rather than rescanning the
+// full start of the table every time.
+static int fat_free_entry(int skip){
+    int i, k;
+
+    for (i = 0; i < FAT_ENTRIES; i++){
+        k = (fs->fat_hint + i) % FAT_ENTRIES;
+        if (k != skip && k != BLOCKSIZE && fat_get(k).data == BLOCKSIZE){
+            fs->fat_hint = k + 1;
+            return k;}
+    }
     return -1;
 }
 
-// Get the value of the first available unused spot
-int first_open(){
-    unsigned int *buff = malloc(BLOCKSIZE);
-    if (!buff){
-        fprintf(stderr, "Malloc failed in 'first_open'\n");
-        return -1;}
+// Link a fresh data block onto the end of the chain at FAT entry cur.
+// Without with_data the entry is left DATA_PENDING for data_put.
+// Returns the new FAT entry, or -1 if the disk is full.
+static int chain_extend(int cur, int with_data){
+    int k = fat_free_entry(cur);
+    if (k == -1) return -1;
+
+    int next = DATA_PENDING;
+    if (with_data){
+        next = first_open();
+        if (next == -1) return -1;
+        set_used(next);}
+
+    FAT_entry current = fat_get(cur);
+    current.next = k;
+    fat_set(k, (FAT_entry) {.data = next, .next = BLOCKSIZE});
+    fat_set(cur, current);
+    return k;
+}
 
-    read_blocks(FREE_LIST, 1, buff);
+// Start a new one-block chain. Returns its FAT entry, or -1 if full.
+static int chain_new(int with_data){
+    int start = fat_free_entry(-1);
+    if (start == -1) return -1;
 
-    int i;
-    for (i = 0; i < BLOCKSIZE/sizeof(unsigned int); i++){
-        int f = ffs(buff[i]);
-        if (f){
-            return f + i*8*sizeof(unsigned int) -1;
-        }
-    }
+    int data = DATA_PENDING;
+    if (with_data){
+        data = first_open();
+        if (data == -1) return -1;
+        set_used(data);}
 
-    return -1;
+    fat_set(start, (FAT_entry) {.data = data, .next = BLOCKSIZE});
+    return start;
 }
 
-// Set indx to allocated
-void set_used(unsigned short indx){
-    int i = indx/(8*sizeof(unsigned int));   // where in bit array to flip
-    int j = indx % (8*sizeof(unsigned int)); //  which bit to flip
-    unsigned int *buff = malloc(BLOCKSIZE);
+// Release every block of the chain starting at FAT entry cur
+static void chain_free(int cur){
+    while (cur != BLOCKSIZE){
+        FAT_entry fat_tr = fat_get(cur);
+        data_release(fat_tr);
+        fat_set(cur, (FAT_entry) {.data = BLOCKSIZE, .next = BLOCKSIZE});
+        cur = fat_tr.next;
+    }
+}
 
-    if (!buff){
-        fprintf(stderr, "Malloc failed in 'set'\n");
-        return;}
+// Build a new chain over the same data blocks as the chain at FAT entry
+// src, taking a reference on each. Returns its first entry, or -1 if the
+// FAT fills up.
+static int chain_clone(int src){
+    int start = BLOCKSIZE, prev = BLOCKSIZE;
 
-    read_blocks(FREE_LIST, 1, buff);
-    buff[i] &= ~(1 << j);
-    write_blocks(FREE_LIST, 1, buff);
+    while (src != BLOCKSIZE){
+        FAT_entry e = fat_get(src);
+        int k = fat_free_entry(-1);
+
+        if (k == -1){
+            chain_free(start);
+            return -1;}
 
+        if (e.data < BLOCKSIZE){
+            block_ref r = ref_get(e.data);
+            r.refs++;
+            ref_set(e.data, r);}
+
+        src = e.next;
+        e.next = BLOCKSIZE;
+        fat_set(k, e);
+        if (prev == BLOCKSIZE){
+            start = k;
+        } else {
+            FAT_entry p = fat_get(prev);
+            p.next = k;
+            fat_set(prev, p);}
+        prev = k;
+    }
+    return start;
 }
 
-// Set indx to free
-void set_unused(unsigned short indx){
-    int i = indx/(8*sizeof(unsigned int));   // where in bit array to flip
-    int j = indx % (8*sizeof(unsigned int)); // which bit to flip
-    unsigned int *buff = malloc(BLOCKSIZE);
-    if (!buff){
-        fprintf(stderr, "Malloc failed in 'clear'\n");
-        return;}
+/*
+ * Directories other than the root are stored as a B-tree inside their own
+ * chain. Each block of the chain is one node, and children are named by
+ * the FAT entry of their block plus one, so finding a node's block takes
+ * a single FAT lookup. Node 0 is always the root of the tree, held by the
+ * first block of the chain, and also carries the header for the whole
+ * directory. Deleting an entry never merges nodes; subtrees that empty out
+ * are returned to a free list.
+ */
+
+// Directory ID used for the flat root directory table
+#define ROOT_DIR BLOCKSIZE
+
+// Values of directory_entry.type
+#define TYPE_FILE 0
+#define TYPE_DIR 1
+
+// Entries per B-tree node is 2t-1 with minimum degree t
+#define DIR_T 8
+#define DIR_KEYS (2*DIR_T - 1)
+
+typedef struct dir_node {
+    unsigned short count;       // entries in this node
+    unsigned short internal;    // 0 for a leaf, so a zeroed node is empty
+    unsigned short free;        // node 0: first free node; others: next free
+    unsigned short nodes;       // node 0 only: blocks in the directory chain
+    unsigned short last;        // node 0 only: FAT entry of the last of them
+    unsigned int entries;       // node 0 only: entries in the whole directory
+    unsigned short child[DIR_KEYS + 1];
+    directory_entry entry[DIR_KEYS];
+} dir_node;
+
+// Disk block holding node n of the directory starting at FAT entry dir
+static int node_block(unsigned short dir, int n){
+    return DATA_START + fat_get(n > 0 ? n - 1 : dir).data;
+}
 
-    read_blocks(FREE_LIST, 1, buff);
-    buff[i] |= 1 << j;
-    write_blocks(FREE_LIST, 1, buff);
+static void node_read(unsigned short dir, int n, dir_node *node){
+    int i;
+
+    memcpy(node, cache_block(node_block(dir, n)), sizeof(dir_node));
+    for (i = 0; i < node->count; i++)
+        node->entry[i].indx = from_disk(node->entry[i].indx);
+}
+
+static void node_write(unsigned short dir, int n, dir_node *node){
+    int i, b = node_block(dir, n);
+    char *page = cache_lookup(b, 0)->data;
+    dir_node *out = (dir_node *) page;
+
+    memcpy(page, node, sizeof(dir_node));
+    memset(page + sizeof(dir_node), 0, BLOCKSIZE - sizeof(dir_node));
+    for (i = 0; i < out->count; i++)
+        out->entry[i].indx = to_disk(out->entry[i].indx);
+    block_write(b, page);
+}
+
+// Get an unused node, growing the chain if the free list is empty.
+// root is the in-memory copy of node 0 and must be written back later,
+// whether or not the caller goes on to succeed.
+static int node_alloc(unsigned short dir, dir_node *root){
+    if (root->free){
+        dir_node node;
+        int n = root->free;
+        node_read(dir, n, &node);
+        root->free = node.free;
+        return n;
+    }
+
+    int k = chain_extend(root->last, 1);
+    if (k == -1)
+        return -1;
+    root->last = k;
+    root->nodes++;
+    return k + 1;
+}
+
+// Put node n and everything below it on the free list
+static void node_release(unsigned short dir, dir_node *root, int n){
+    dir_node node;
+    int i;
+
+    node_read(dir, n, &node);
+    for (i = 0; node.internal && i <= node.count; i++)
+        node_release(dir, root, node.child[i]);
+
+    memset(&node, 0, sizeof(node));
+    node.free = root->free;
+    node_write(dir, n, &node);
+    root->free = n;
+}
+
+// Index of the first entry in node not less than name
+static int node_search(dir_node *node, const char *name){
+    int lo = 0, hi = node->count;
+
+    while (lo < hi){
+        int mid = (lo + hi) / 2;
+        if (strcmp(node->entry[mid].name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Find name, reading one node per level. On success *n and *i locate it.
+static int btree_find(unsigned short dir, const char *name, dir_node *node,
+                      int *n, int *i){
+    *n = 0;
+    while (1){
+        node_read(dir, *n, node);
+        *i = node_search(node, name);
+        if (*i < node->count && strcmp(node->entry[*i].name, name) == 0)
+            return 0;
+        if (!node->internal)
+            return -1;
+        *n = node->child[*i];
+    }
+}
+
+// Split the full child i of parent, which is node p
+static int btree_split(unsigned short dir, dir_node *root, dir_node *parent,
+                       int p, int i){
+    dir_node child, sib;
+    int c = parent->child[i];
+    int s = node_alloc(dir, root);
+    if (s == -1)
+        return -1;
+
+    node_read(dir, c, &child);
+    memset(&sib, 0, sizeof(sib));
+    sib.internal = child.internal;
+    sib.count = DIR_T - 1;
+    memcpy(sib.entry, child.entry + DIR_T, (DIR_T - 1) * sizeof(directory_entry));
+    if (child.internal)
+        memcpy(sib.child, child.child + DIR_T, DIR_T * sizeof(unsigned short));
+    child.count = DIR_T - 1;
+
+    memmove(parent->entry + i + 1, parent->entry + i,
+            (parent->count - i) * sizeof(directory_entry));
+    memmove(parent->child + i + 2, parent->child + i + 1,
+            (parent->count - i) * sizeof(unsigned short));
+    parent->entry[i] = child.entry[DIR_T - 1];
+    parent->child[i + 1] = s;
+    parent->count++;
+
+    node_write(dir, c, &child);
+    node_write(dir, s, &sib);
+    if (p != 0)
+        node_write(dir, p, parent);
+    return 0;
+}
+
+// Add e, splitting full nodes on the way down so the leaf has room
+static int btree_insert(unsigned short dir, directory_entry e){
+    dir_node root, buf;
+
+    node_read(dir, 0, &root);
+
+    if (root.count == DIR_KEYS){
+        // Move the root's contents down a level and split them
+        int n = node_alloc(dir, &root);
+        if (n == -1)
+            return -1;
+        buf = root;
+        buf.free = buf.nodes = buf.entries = 0;
+        node_write(dir, n, &buf);
+
+        // A root left with one child and no entries is still a sound tree
+        root.count = 0;
+        root.internal = 1;
+        root.child[0] = n;
+        if (btree_split(dir, &root, &root, 0, 0) == -1){
+            node_write(dir, 0, &root);
+            return -1;}
+    }
+
+    dir_node *node = &root, child;
+    int cur = 0;
+
+    while (node->internal){
+        int i = node_search(node, e.name);
+
+        node_read(dir, node->child[i], &child);
+        if (child.count == DIR_KEYS){
+            if (btree_split(dir, &root, node, cur, i) == -1){
+                node_write(dir, 0, &root);
+                return -1;}
+            if (strcmp(e.name, node->entry[i].name) > 0)
+                i++;
+        }
+
+        cur = node->child[i];
+        node_read(dir, cur, &buf);
+        node = &buf;
+    }
+
+    int i = node_search(node, e.name);
+    memmove(node->entry + i + 1, node->entry + i,
+            (node->count - i) * sizeof(directory_entry));
+    node->entry[i] = e;
+    node->count++;
+    if (cur != 0)
+        node_write(dir, cur, node);
+
+    root.entries++;
+    node_write(dir, 0, &root);
+    return 0;
+}
+
+// Remove the largest entry below node n into *out. Fails if the subtree
+// holds no entries at all.
+static int btree_pop_max(unsigned short dir, dir_node *root, int n,
+                         directory_entry *out){
+    dir_node node;
+
+    node_read(dir, n, &node);
+    if (node.internal && btree_pop_max(dir, root, node.child[node.count], out) == 0)
+        return 0;
+    if (node.count == 0)
+        return -1;
+
+    // Nothing to the right of the last entry, so it is the largest
+    *out = node.entry[node.count - 1];
+    if (node.internal)
+        node_release(dir, root, node.child[node.count]);
+    node.count--;
+    node_write(dir, n, &node);
+    return 0;
+}
+
+static int btree_remove(unsigned short dir, const char *name){
+    dir_node root, buf, *node;
+    int n, i;
+
+    if (btree_find(dir, name, &buf, &n, &i) == -1)
+        return -1;
+
+    node_read(dir, 0, &root);
+    node = n == 0 ? &root : &buf;
+
+    if (!node->internal){
+        memmove(node->entry + i, node->entry + i + 1,
+                (node->count - i - 1) * sizeof(directory_entry));
+        node->count--;
+    } else if (btree_pop_max(dir, &root, node->child[i], &node->entry[i]) == -1){
+        // The left subtree is empty: drop it along with the entry
+        node_release(dir, &root, node->child[i]);
+        memmove(node->entry + i, node->entry + i + 1,
+                (node->count - i - 1) * sizeof(directory_entry));
+        memmove(node->child + i, node->child + i + 1,
+                (node->count - i) * sizeof(unsigned short));
+        node->count--;
+    }
+
+    if (n != 0)
+        node_write(dir, n, node);
+    root.entries--;
+    node_write(dir, 0, &root);
+    return 0;
+}
+
+// Print every entry below node n in name order
+static void btree_list(unsigned short dir, int n){
+    dir_node node;
+    int i;
+
+    node_read(dir, n, &node);
+    for (i = 0; i <= node.count; i++){
+        if (node.internal)
+            btree_list(dir, node.child[i]);
+        if (i == node.count)
+            break;
+        if (node.entry[i].type == TYPE_DIR)
+            printf("%12s: <dir>\n", node.entry[i].name);
+        else
+            printf("%12s: %d\n", node.entry[i].name, node.entry[i].size);
+    }
+}
+
+// Look name up in directory dir. slot receives the root directory index
+// of the entry when dir is the root.
+static int dir_lookup(unsigned short dir, const char *name, directory_entry *out,
+                      int *slot){
+    if (dir != ROOT_DIR){
+        dir_node node;
+        int n, i;
+        if (btree_find(dir, name, &node, &n, &i) == -1)
+            return -1;
+        *out = node.entry[i];
+        return 0;
+    }
+
+    int i;
+    for (i = 0; i < fs->dir_hwm; i++){
+        directory_entry e = dir_get(i);
+        if (e.name[0] != '\0' && strcmp(e.name, name) == 0){
+            *out = e;
+            if (slot)
+                *slot = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int dir_insert(unsigned short dir, directory_entry e, int *slot){
+    if (dir != ROOT_DIR)
+        return btree_insert(dir, e);
+
+    int i;
+    for (i = 0; i < BLOCKSIZE; i++){
+        // Find an empty spot
+        if (i >= fs->dir_hwm || dir_get(i).name[0] == '\0'){
+            dir_set(i, e);
+            dir_grow(i);
+            if (slot)
+                *slot = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int dir_remove(unsigned short dir, const char *name, int slot){
+    if (dir != ROOT_DIR)
+        return btree_remove(dir, name);
+
+    dir_set(slot, (directory_entry) {.name = "\0", .indx = BLOCKSIZE});
+    return 0;
+}
+
+// Replace the entry called e.name in place
+static void dir_update(unsigned short dir, int slot, directory_entry e){
+    if (dir == ROOT_DIR){
+        dir_set(slot, e);
+        return;
+    }
+
+    dir_node node;
+    int n, i;
+    if (btree_find(dir, e.name, &node, &n, &i) == 0){
+        node.entry[i] = e;
+        node_write(dir, n, &node);
+    }
+}
+
+// Split path into the directory holding its last component and the
+// component itself. Fails if an intermediate directory does not exist.
+static int resolve(const char *path, unsigned short *parent, char *leaf){
+    unsigned short dir = ROOT_DIR;
+
+    while (*path == '/')
+        path++;
+
+    while (1){
+        const char *end = strchr(path, '/');
+        int len = end ? end - path : strlen(path);
+        char name[MAX_FNAME_LENGTH + 1];
+
+        if (len == 0 || len > MAX_FNAME_LENGTH)
+            return -1;
+        memcpy(name, path, len);
+        name[len] = '\0';
+
+        while (end && *end == '/')
+            end++;
+
+        if (!end || *end == '\0'){
+            strcpy(leaf, name);
+            *parent = dir;
+            return 0;
+        }
+
+        directory_entry e;
+        if (dir_lookup(dir, name, &e, NULL) == -1 || e.type != TYPE_DIR)
+            return -1;
+        dir = e.indx;
+        path = end;
+    }
+}
+
+void sfs_ls_r(sfs_t *h){
+    fs = h;
+    if (!fs){   // Check file system is initialized
+        fprintf(stderr,
+            "Error in sfs_ls.\nFile system neads to be initialized first");
+        return;}
+
+    int i;
+
+    for (i = 0; i < fs->dir_hwm; i++){        // Print out files and sizes
+        directory_entry e = dir_get(i);
+        if (strncmp(e.name, "\0", 1) != 0){
+            if (e.type == TYPE_DIR)
+                printf("%12s: <dir>\n", e.name);
+            else
+                printf("%12s: %d\n", e.name, e.size);
+        }
+    }
+}
+
+// List a directory in name order. The root is listed as by sfs_ls.
+int sfs_lsdir_r(sfs_t *h, char *path){
+    fs = h;
+    if (!fs){
+        fprintf(stderr,
+            "Error in sfs_lsdir.\nFile system neads to be initialized first");
+        return -1;}
+
+    while (*path == '/')
+        path++;
+    if (*path == '\0'){
+        sfs_ls_r(fs);
+        return 0;}
+
+    unsigned short parent;
+    char name[MAX_FNAME_LENGTH + 1];
+    directory_entry e;
+
+    if (resolve(path, &parent, name) == -1 || dir_lookup(parent, name, &e, NULL) == -1
+        || e.type != TYPE_DIR)
+        return -1;
+
+    btree_list(e.indx, 0);
+    return 0;
+}
+
+// Start an empty directory. Returns its first FAT entry, or -1 if full.
+static int dir_new(){
+    int start = chain_new(1);
+    if (start == -1)
+        return -1;
+
+    dir_node root;
+    memset(&root, 0, sizeof(root));
+    root.nodes = 1;
+    root.last = start;
+    node_write(start, 0, &root);
+    return start;
+}
+
+static void entry_free(directory_entry e);
+
+// Release everything stored below node n of directory dir
+static void tree_free(unsigned short dir, int n){
+    dir_node node;
+    int i;
+
+    node_read(dir, n, &node);
+    for (i = 0; i <= node.count; i++){
+        if (node.internal)
+            tree_free(dir, node.child[i]);
+        if (i < node.count)
+            entry_free(node.entry[i]);
+    }
+}
+
+// Release the blocks of a file, or of a directory and all it contains
+static void entry_free(directory_entry e){
+    if (e.type == TYPE_DIR)
+        tree_free(e.indx, 0);
+    chain_free(e.indx);
+}
+
+static int entry_clone(directory_entry *e, unsigned short skip);
+
+// Add a clone of every entry below node n of directory src to directory
+// dst, leaving out the directory starting at FAT entry skip
+static int tree_clone(unsigned short src, int n, unsigned short dst,
+                      unsigned short skip){
+    dir_node node;
+    int i;
+
+    node_read(src, n, &node);
+    for (i = 0; i <= node.count; i++){
+        if (node.internal && tree_clone(src, node.child[i], dst, skip) == -1)
+            return -1;
+        if (i == node.count)
+            break;
+
+        directory_entry e = node.entry[i];
+        if (e.type == TYPE_DIR && e.indx == skip)
+            continue;
+        if (entry_clone(&e, skip) == -1)
+            return -1;
+        if (dir_insert(dst, e, NULL) == -1){
+            entry_free(e);
+            return -1;}
+    }
+    return 0;
+}
+
+// Point e at a copy of what it names: a file's blocks are shared with the
+// original, a directory's entries are cloned one by one
+static int entry_clone(directory_entry *e, unsigned short skip){
+    int start;
+
+    if (e->type == TYPE_DIR){
+        start = dir_new();
+        if (start == -1)
+            return -1;
+        if (tree_clone(e->indx, 0, start, skip) == -1){
+            tree_free(start, 0);
+            chain_free(start);
+            return -1;}
+    } else if (e->indx != BLOCKSIZE){
+        start = chain_clone(e->indx);
+        if (start == -1)
+            return -1;
+    } else {
+        return 0;   // inline, already copied along with the entry
+    }
+    e->indx = start;
+    return 0;
+}
+
+// Negative return value => parent missing, name taken or disk full
+int sfs_mkdir_r(sfs_t *h, char *path){
+    fs = h;
+    if (!fs){
+        fprintf(stderr,
+            "Error in sfs_mkdir.\nFile system neads to be opened first");
+        return -1;}
+
+    unsigned short parent;
+    char name[MAX_FNAME_LENGTH + 1];
+    directory_entry e;
+
+    if (resolve(path, &parent, name) == -1 || dir_lookup(parent, name, &e, NULL) == 0)
+        return -1;
+
+    int start = dir_new();
+    if (start == -1)
+        return -1;
+
+    memset(&e, 0, sizeof(e));
+    strncpy(e.name, name, MAX_FNAME_LENGTH + 1);
+    e.type = TYPE_DIR;
+    e.indx = start;
+    if (dir_insert(parent, e, NULL) == -1){
+        chain_free(start);
+        return -1;}
+    return 0;
+}
+
+// Double the descriptor slab, chaining the new descriptors onto the free
+// list. Only needed while more files are open than ever before.
+static int fd_grow(){
+    int n = fs->nfds ? 2 * fs->nfds : SLAB_START, fd;
+    file_descriptor *more = realloc(fs->fds, n * sizeof(file_descriptor));
+
+    if (!more)
+        return -1;
+    fs->fds = more;
+    for (fd = n - 1; fd >= fs->nfds; fd--){
+        fs->fds[fd].file = NO_FILE;
+        fs->fds[fd].next = fs->free_fd;
+        fs->free_fd = fd;}
+    fs->nfds = n;
+    return 0;
+}
+
+// Take a descriptor off the free list
+static int fd_alloc(){
+    int fd;
+
+    if (fs->free_fd == -1 && fd_grow() == -1)
+        return -1;
+    fd = fs->free_fd;
+    fs->free_fd = fs->fds[fd].next;
+    return fd;
+}
+
+static void fd_release(int fd){
+    fs->fds[fd].file = NO_FILE;
+    fs->fds[fd].next = fs->free_fd;
+    fs->free_fd = fd;
+}
+
+// Make sure we have a valid fileID
+static file_descriptor *get_fd(int fileID){
+    if (!fs || fileID < 0 || fileID >= fs->nfds || fs->fds[fileID].file == NO_FILE)
+        return NULL;
+    return &fs->fds[fileID];
+}
+
+// The open file behind a valid fileID
+static open_file *get_file(int fileID){
+    file_descriptor *d = get_fd(fileID);
+
+    return d ? &fs->files[d->file] : NULL;
+}
+
+// Double the open file slab, as fd_grow does for descriptors
+static int file_grow(){
+    int n = fs->nfiles ? 2 * fs->nfiles : SLAB_START, k;
+    open_file *more = realloc(fs->files, n * sizeof(open_file));
+
+    if (!more)
+        return -1;
+    fs->files = more;
+    for (k = n - 1; k >= fs->nfiles; k--){
+        fs->files[k].refs = 0;
+        fs->files[k].next = fs->free_file;
+        fs->free_file = k;}
+    fs->nfiles = n;
+    return 0;
+}
+
+static int *file_bucket(unsigned short parent, const char *name){
+    unsigned int h = parent;
+
+    while (*name)
+        h = h * 31 + (unsigned char) *name++;
+    return &fs->file_hash[h % FILE_BUCKETS];
+}
+
+// Open file slot of name in directory parent, or -1 if it isn't in use
+static int file_find(unsigned short parent, const char *name){
+    int k;
+
+    for (k = *file_bucket(parent, name); k != -1; k = fs->files[k].next){
+        if (fs->files[k].parent == parent && strcmp(fs->files[k].name, name) == 0)
+            return k;}
+    return -1;
+}
+
+// Start tracking the file with entry e at slot of directory parent.
+// Returns its open file slot, with no references yet.
+static int file_new(unsigned short parent, const char *name, int slot,
+                    directory_entry e){
+    int k, *bucket;
+
+    if (fs->free_file == -1 && file_grow() == -1)
+        return -1;
+    k = fs->free_file;
+
+    open_file *f = &fs->files[k];
+    fs->free_file = f->next;
+    f->size = e.size;
+    f->start = e.indx;
+    f->parent = parent;
+    f->slot = slot;
+    f->refs = 0;
+    f->fd = -1;
+    strcpy(f->name, name);
+
+    bucket = file_bucket(parent, name);
+    f->next = *bucket;
+    *bucket = k;
+    return k;
+}
+
+// Drop a reference to open file k, forgetting the file with the last one
+static void file_put(int k){
+    open_file *f = &fs->files[k];
+    int *p;
+
+    if (--f->refs > 0)
+        return;
+    for (p = file_bucket(f->parent, f->name); *p != k; p = &fs->files[*p].next)
+        ;
+    *p = f->next;
+    f->next = fs->free_file;
+    fs->free_file = k;
+}
+
+int sfs_fopen_r(sfs_t *h, char *name){
+    fs = h;
+    // Make sure file system has been initialized
+    if (!fs){
+        fprintf(stderr,
+            "Error in sfs_fopen.\nFile system neads to be opened first");
+        return -1;}
+
+    // Check name is valid and its directory exists
+    unsigned short parent;
+    char leaf[MAX_FNAME_LENGTH + 1];
+    if (resolve(name, &parent, leaf) == -1)
+        return -1;
+
+    directory_entry e;
+    int slot = 0, fd, k = -1;
+
+    // Check if file exists
+    if (dir_lookup(parent, leaf, &e, &slot) == 0){
+        if (e.type != TYPE_FILE)
+            return -1;
+
+        // Make sure we haven't already opened this file.
+        // If so, return the original file descriptor
+        k = file_find(parent, leaf);
+        if (k != -1 && fs->files[k].fd != -1)
+            return fs->files[k].fd;
+    } else {
+        // Otherwise, the file has't been created, so create it. It starts
+        // out inline and gets blocks only once it outgrows its entry.
+        memset(&e, 0, sizeof(e));
+        strncpy(e.name, leaf, MAX_FNAME_LENGTH + 1);
+        e.type = TYPE_FILE;
+        e.indx = BLOCKSIZE;
+        if (dir_insert(parent, e, &slot) == -1)
+            return -1;
+    }
+
+    // A file that is closed but still mapped is already being tracked
+    fd = fd_alloc();
+    if (fd == -1 || (k == -1 && (k = file_new(parent, leaf, slot, e)) == -1)){
+        if (fd != -1)
+            fd_release(fd);
+        fprintf(stderr, "Error opening %12s", name);
+        return -1;}
+
+    // Initialize file descriptor with correct info
+    fs->files[k].fd = fd;
+    fs->files[k].refs++;
+    fs->fds[fd].file = k;
+    fs->fds[fd].read_ptr = 0;
+    fs->fds[fd].write_ptr = fs->files[k].size;
+    return fd;
+}
+
+// Make sure that the file descriptor is valid
+int sfs_fclose_r(sfs_t *h, int fileID){
+    fs = h;
+    // Make sure fileID is valid and fileID hasn't already been closed
+    file_descriptor *d = get_fd(fileID);
+    if (d == NULL)
+        return -1;
+
+    fs->files[d->file].fd = -1;
+    file_put(d->file);
+    fd_release(fileID);
+    return 0;
+}
+
+// Fetch the directory entry of an open file
+static int fd_entry(open_file *f, directory_entry *e){
+    if (f->parent == ROOT_DIR){
+        *e = dir_get(f->slot);
+        return 0;}
+    return dir_lookup(f->parent, f->name, e, NULL);
+}
+
+// Cache page holding an open file's directory entry, and the offset of
+// the entry within it. Entries never straddle blocks.
+static cache_page *fd_entry_page(open_file *f, int *off){
+    if (f->parent == ROOT_DIR){
+        int pos = f->slot * sizeof(directory_entry);
+        *off = pos % BLOCKSIZE;
+        return cache_lookup(ROOT_LOC + pos / BLOCKSIZE, 1);
+    }
+
+    dir_node node;
+    int n, i;
+    if (btree_find(f->parent, f->name, &node, &n, &i) == -1)
+        return NULL;
+    *off = (char *) &node.entry[i] - (char *) &node;
+    return cache_lookup(node_block(f->parent, n), 1);
+}
+
+// Move an inline file's contents into a newly allocated first block
+static int spill(open_file *f){
+    directory_entry e;
+
+    if (fd_entry(f, &e) == -1)
+        return -1;
+
+    int start = chain_new(!(fs->sfs_flags & (SFS_DEDUP | SFS_LOG)));
+    if (start == -1)
+        return -1;
+
+    char block[BLOCKSIZE];
+    FAT_entry fe = fat_get(start);
+    memset(block, 0, BLOCKSIZE);
+    memcpy(block, e.data, f->size);
+    if (data_put(start, &fe, block) == -1){
+        chain_free(start);
+        return -1;}
+
+    e.indx = start;
+    memset(e.data, 0, INLINE_MAX);
+    dir_update(f->parent, f->slot, e);
+    f->start = start;
+    return 0;
+}
+
+// Move n bytes between blk and the iovec array, advancing (*v, *voff)
+static void iov_copy(const struct iovec *iov, int *v, size_t *voff,
+                     char *blk, int n, int write){
+    while (n > 0){
+        int m = iov[*v].iov_len - *voff < n ? iov[*v].iov_len - *voff : n;
+        char *user = (char *) iov[*v].iov_base + *voff;
+
+        if (write)
+            memcpy(blk, user, m);
+        else
+            memcpy(user, blk, m);
+
+        blk += m;
+        n -= m;
+        *voff += m;
+        if (*voff == iov[*v].iov_len){
+            (*v)++;
+            *voff = 0;}
+    }
+}
+
+// Transfer the iovec array to or from the file at offset. The FAT is
+// walked once and the directory entry updated once for the whole batch.
+// Returns the number of bytes moved, or -1 if nothing could be.
+static int file_io(open_file *f, unsigned int offset,
+                   const struct iovec *iov, int iovcnt, int write){
+    int length = 0, i;
+
+    for (i = 0; i < iovcnt; i++){
+        if ((int) iov[i].iov_len < 0 || length + (int) iov[i].iov_len < length)
+            return -1;
+        length += iov[i].iov_len;}
+
+    // Make sure we aren't reading past the last written byte of the file
+    if (!write){
+        if (offset >= f->size)
+            return 0;
+        if (offset + length > f->size)
+            length = f->size - offset;}
+
+    if (length == 0)
+        return 0;
+
+    if (f->start == BLOCKSIZE){
+        if (write && offset + length > INLINE_MAX){
+            if (spill(f) == -1)
+                return -1;
+        } else {
+            // Small enough to stay inside the directory entry
+            directory_entry e;
+            int v = 0;
+            size_t voff = 0;
+
+            if (fd_entry(f, &e) == -1)
+                return -1;
+            while (v < iovcnt && iov[v].iov_len == 0)
+                v++;
+            iov_copy(iov, &v, &voff, e.data + offset, length, write);
+            if (write){
+                if (offset + length > f->size)
+                    f->size = e.size = offset + length;
+                dir_update(f->parent, f->slot, e);
+            }
+            return length;
+        }
+    }
+
+    int cur = f->start;
+    FAT_entry current = fat_get(cur);
+    int blk = offset / BLOCKSIZE;   // which sector offset is in
+    int j = offset % BLOCKSIZE;     // how far into sector offset is
+    int last = f->size ? (f->size - 1) / BLOCKSIZE : 0;  // last sector in use
+
+    // Find the correct sector. Writing past the end of the file grows the
+    // chain with holes, which take no data blocks until written.
+    for (i = 0; i < blk; i++){
+        if (current.next == BLOCKSIZE){
+            if (!write)
+                return -1;  // chain is shorter than the recorded size
+            cur = chain_extend(cur, 0);
+            if (cur == -1)
+                return -1;
+            current = fat_get(cur);
+            current.data = DATA_HOLE;
+            fat_set(cur, current);
+        } else {
+            cur = current.next;
+            current = fat_get(cur);}
+    }
+
+    int v = 0, done = 0;
+    size_t voff = 0;
+    char block_buf[BLOCKSIZE];  // staging for blocks that get compressed
+
+    while (v < iovcnt && iov[v].iov_len == 0)
+        v++;
+
+    while (done < length){
+        int n = BLOCKSIZE - j < length - done ? BLOCKSIZE - j : length - done;
+
+        if (write){
+            // Holes and blocks past the old end of file hold nothing worth
+            // keeping, and whole-block writes need not read the old contents
+            int hole = current.data == DATA_HOLE;
+            int fresh = hole || blk > last || f->size == 0;
+            char *page;
+
+            // Compressed and logged blocks move, and shared ones are
+            // copied, so none can be changed in their cache page. Holes
+            // have none.
+            if ((fs->sfs_flags & (SFS_COMPRESS | SFS_DEDUP | SFS_LOG)) || is_shared(current) || hole){
+                page = block_buf;
+                fs->io_error = 0;
+                if (fresh)
+                    memset(page, 0, BLOCKSIZE);
+                else if (n < BLOCKSIZE)
+                    memcpy(page, data_get(current), BLOCKSIZE);
+            } else {
+                fs->io_error = 0;
+                page = cache_lookup(DATA_START + current.data,
+                                    !fresh && n < BLOCKSIZE)->data;
+                if (fresh && n < BLOCKSIZE)
+                    memset(page, 0, BLOCKSIZE);
+            }
+            // Don't write a damaged block back under a fresh checksum
+            if (fs->io_error)
+                break;
+            iov_copy(iov, &v, &voff, page + j, n, 1);
+            if (data_put(cur, &current, page) == -1)
+                break;
+        } else {
+            int run = 0, room = v < iovcnt ? (iov[v].iov_len - voff) / BLOCKSIZE : 0;
+
+            // Whole blocks bound for one buffer go straight there, several
+            // to a request, rather than a block at a time through the cache
+            if (j == 0 && room > 1 && length - done >= 2 * BLOCKSIZE)
+                run = data_run(current, room < (length - done) / BLOCKSIZE
+                                        ? room : (length - done) / BLOCKSIZE);
+            if (run > 1 && block_read(DATA_START + current.data, run,
+                                      (char *) iov[v].iov_base + voff) == run){
+                voff += run * BLOCKSIZE;
+                if (voff == iov[v].iov_len){
+                    v++;
+                    voff = 0;}
+                // The last block of the run is counted below
+                done += (run - 1) * BLOCKSIZE;
+                blk += run - 1;
+                while (--run > 0){
+                    cur = current.next;
+                    current = fat_get(cur);}
+            } else {
+                fs->io_error = 0;
+                char *src = data_get(current);
+                if (fs->io_error)
+                    break;
+                iov_copy(iov, &v, &voff, src + j, n, 0);
+            }
+        }
+
+        done += n;
+        j = 0;
+        blk++;
+
+        if (done < length){
+            if (current.next != BLOCKSIZE){
+                cur = current.next;
+            } else if (!write
+                       || (cur = chain_extend(cur, !(fs->sfs_flags & (SFS_DEDUP | SFS_LOG)))) == -1){
+                break;  // end of chain or disk full: report a short transfer
+            }
+            current = fat_get(cur);
+        }
+    }
+    // Make room in the log for as much again as was just written
+    if (write && (fs->sfs_flags & SFS_LOG))
+        log_clean(LOG_CLEAN_STEP * ((done + BLOCKSIZE - 1) / BLOCKSIZE));
+
+    // Increase the size of the file as necessary
+    if (write && offset + done > f->size){
+        f->size = offset + done;
+
+        directory_entry e;
+        if (fd_entry(f, &e) == -1)
+            return done;
+        e.size = f->size;
+        dir_update(f->parent, f->slot, e);
+    }
+
+    return done ? done : -1;
+}
+
+int sfs_fwrite_r(sfs_t *h, int fileID, char *buf, int length){
+    fs = h;
+    file_descriptor *to_write = get_fd(fileID);
+
+    if (buf == NULL || length < 0 || to_write == NULL)
+        return -1;
+
+    // Blocks written earlier that failed to reach the disk fail this write
+    if (wb_failed())
+        return -1;
+
+    struct iovec iov = {.iov_base = buf, .iov_len = length};
+    int written = file_io(&fs->files[to_write->file], to_write->write_ptr, &iov, 1, 1);
+
+    // Increase the write_ptr
+    if (written > 0)
+        to_write->write_ptr += written;
+    return written;
+}
+
+// Negative return value => invalid file ID
+int sfs_fread_r(sfs_t *h, int fileID, char *buf, int length){
+    fs = h;
+    file_descriptor *to_read = get_fd(fileID);
+
+    if (length < 0 || buf == NULL || to_read == NULL)
+        return -1;
+
+    struct iovec iov = {.iov_base = buf, .iov_len = length};
+    int read = file_io(&fs->files[to_read->file], to_read->read_ptr, &iov, 1, 0);
+
+    if (read > 0)
+        to_read->read_ptr += read;
+    return read;
+}
+
+// Like sfs_fwrite, but gathers from several buffers and writes at offset
+// without moving the file's read or write pointer
+int sfs_fwritev_r(sfs_t *h, int fileID, const struct iovec *iov, int iovcnt, int offset){
+    fs = h;
+    open_file *to_write = get_file(fileID);
+
+    if (iov == NULL || iovcnt < 0 || offset < 0 || to_write == NULL)
+        return -1;
+
+    return file_io(to_write, offset, iov, iovcnt, 1);
+}
+
+// Like sfs_fread, but scatters into several buffers and reads at offset
+// without moving the file's read or write pointer
+int sfs_freadv_r(sfs_t *h, int fileID, const struct iovec *iov, int iovcnt, int offset){
+    fs = h;
+    open_file *to_read = get_file(fileID);
+
+    if (iov == NULL || iovcnt < 0 || offset < 0 || to_read == NULL)
+        return -1;
+
+    return file_io(to_read, offset, iov, iovcnt, 0);
+}
+
+// Read length bytes at offset without copying: view is filled with one
+// segment per block, each pointing into a cache page that stays pinned
+// until sfs_release_view. Returns the number of bytes in the view.
+int sfs_fread_view_r(sfs_t *h, int fileID, int offset, int length, sfs_view *view){
+    fs = h;
+    open_file *to_read = get_file(fileID);
+
+    if (view == NULL || offset < 0 || length < 0 || to_read == NULL)
+        return -1;
+
+    view->count = 0;
+    view->iov = NULL;
+    view->pages = NULL;
+
+    // Make sure we aren't reading past the last written byte of the file
+    if (offset >= to_read->size)
+        return 0;
+    if (offset + length > to_read->size)
+        length = to_read->size - offset;
+    if (length == 0)
+        return 0;
+
+    int blk = offset / BLOCKSIZE;
+    int j = offset % BLOCKSIZE;
+    int count = to_read->start == BLOCKSIZE ? 1 : (j + length + BLOCKSIZE - 1) / BLOCKSIZE;
+
+    // Compressed blocks have no page to point into
+    if (to_read->start != BLOCKSIZE && (fs->sfs_flags & SFS_COMPRESS))
+        return -1;
+
+    // Leave enough unpinned pages for everything else to keep working
+    if (fs->cache_pinned + count > CACHE_PAGES - CACHE_RESERVE)
+        return -1;
+
+    view->iov = malloc(count * sizeof(struct iovec));
+    view->pages = malloc(count * sizeof(void *));
+    if (!view->iov || !view->pages){
+        free(view->iov);
+        free(view->pages);
+        return -1;}
+
+    // An inline file is viewed inside its directory entry
+    if (to_read->start == BLOCKSIZE){
+        int off;
+        cache_page *page = fd_entry_page(to_read, &off);
+        if (page == NULL){
+            sfs_release_view_r(fs, view);
+            return -1;}
+        if (page->pins++ == 0)
+            fs->cache_pinned++;
+        view->pages[0] = page;
+        view->iov[0].iov_base = page->data + off + offsetof(directory_entry, data) + offset;
+        view->iov[0].iov_len = length;
+        view->count = 1;
+        return length;
+    }
+
+    FAT_entry current = fat_get(to_read->start);
+    int i;
+
+    for (i = 0; i < blk && current.next != BLOCKSIZE; i++)
+        current = fat_get(current.next);
+
+    int done = 0;
+    while (done < length && i == blk){
+        int n = BLOCKSIZE - j < length - done ? BLOCKSIZE - j : length - done;
+        cache_page *page = NULL;
+
+        // Holes are viewed as shared zeros, with no page to pin
+        if (current.data != DATA_HOLE){
+            fs->io_error = 0;
+            page = cache_lookup(DATA_START + current.data, 1);
+            if (fs->io_error)
+                break;
+            if (page->pins++ == 0)
+                fs->cache_pinned++;}
+        view->pages[view->count] = page;
+        view->iov[view->count].iov_base = (page ? page->data : (char *) zero_block) + j;
+        view->iov[view->count].iov_len = n;
+        view->count++;
+
+        done += n;
+        j = 0;
+        if (current.next == BLOCKSIZE)
+            break;
+        current = fat_get(current.next);
+        i++;
+        blk++;
+    }
+
+    if (done == 0)
+        sfs_release_view_r(fs, view);
+    return done ? done : -1;
+}
+
+// Unpin the pages behind a view returned by sfs_fread_view
+void sfs_release_view_r(sfs_t *h, sfs_view *view){
+    fs = h;
+    int i;
+
+    if (!fs || view == NULL)
+        return;
+
+    for (i = 0; i < view->count; i++){
+        cache_page *page = view->pages[i];
+        if (page && --page->pins == 0)
+            fs->cache_pinned--;
+    }
+
+    free(view->iov);
+    free(view->pages);
+    view->count = 0;
+    view->iov = NULL;
+    view->pages = NULL;
+}
+
+// Map length bytes of the file at offset into memory. The region is
+// filled from the file up front; with SFS_MAP_WRITE it is writable, and
+// changes reach the file on sfs_msync or sfs_munmap. The mapping keeps
+// the file in use, so it may be closed while mapped, and the mapping
+// never extends the file.
+void *sfs_mmap_r(sfs_t *h, int fileID, int offset, int length, int flags){
+    fs = h;
+    file_descriptor *d = get_fd(fileID);
+    open_file *f = d ? &fs->files[d->file] : NULL;
+
+    if (f == NULL || offset < 0 || length <= 0 || !(flags & SFS_MAP_READ)
+        || offset + length < offset || offset + length > f->size)
+        return NULL;
+
+    mapping *m = malloc(sizeof(mapping));
+    if (!m){
+        fprintf(stderr, "Malloc failed in 'sfs_mmap'\n");
+        return NULL;}
+
+    m->addr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m->addr == MAP_FAILED){
+        free(m);
+        return NULL;}
+
+    struct iovec iov = {.iov_base = m->addr, .iov_len = length};
+    if (file_io(f, offset, &iov, 1, 0) != length
+        || (!(flags & SFS_MAP_WRITE) && mprotect(m->addr, length, PROT_READ) != 0)){
+        munmap(m->addr, length);
+        free(m);
+        return NULL;}
+
+    m->length = length;
+    m->offset = offset;
+    m->file = d->file;
+    m->flags = flags;
+    f->refs++;
+    m->next = fs->maps;
+    fs->maps = m;
+    return m->addr;
+}
+
+static mapping **find_mapping(void *addr){
+    mapping **m;
+
+    if (!fs)
+        return NULL;
+    for (m = &fs->maps; *m; m = &(*m)->next){
+        if ((*m)->addr == addr)
+            return m;
+    }
+    return NULL;
+}
+
+// Write a writable mapping back to its file
+int sfs_msync_r(sfs_t *h, void *addr){
+    fs = h;
+    mapping **m = find_mapping(addr);
+
+    if (m == NULL)
+        return -1;
+    if (!((*m)->flags & SFS_MAP_WRITE))
+        return 0;
+
+    struct iovec iov = {.iov_base = (*m)->addr, .iov_len = (*m)->length};
+    return file_io(&fs->files[(*m)->file], (*m)->offset, &iov, 1, 1) == (*m)->length ? 0 : -1;
+}
+
+// Write back and release a region returned by sfs_mmap
+int sfs_munmap_r(sfs_t *h, void *addr){
+    fs = h;
+    mapping **m = find_mapping(addr);
+
+    if (m == NULL)
+        return -1;
+
+    int ret = sfs_msync_r(fs, addr);
+    mapping *gone = *m;
+    *m = gone->next;
+    munmap(gone->addr, gone->length);
+    file_put(gone->file);
+    free(gone);
+    return ret;
+}
+
+// Negative return value => invalid file ID
+int sfs_fseek_r(sfs_t *h, int fileID, int offset){
+    fs = h;
+    file_descriptor *d = get_fd(fileID);
+    if (d == NULL)
+        return -1;
+
+    d->read_ptr = offset;
+    d->write_ptr = offset;
+    return 0;
+}
+
+// Size in bytes of an open file. Negative return value => invalid file ID
+int sfs_fsize_r(sfs_t *h, int fileID){
+    fs = h;
+    open_file *f = get_file(fileID);
+    if (f == NULL)
+        return -1;
+
+    return f->size;
+}
+
+// Record a new size for f in its directory entry, along with its start
+static void file_resize(open_file *f, unsigned int size){
+    directory_entry e;
+
+    f->size = size;
+    if (fd_entry(f, &e) == -1)
+        return;
+    e.size = size;
+    e.indx = f->start;
+    dir_update(f->parent, f->slot, e);
+}
+
+// Make f's chain at least n blocks long, growing it with holes. Returns
+// the FAT entry of block n - 1, or -1 if the FAT is full.
+static int chain_cover(open_file *f, int n){
+    int cur, i;
+
+    if (f->start == BLOCKSIZE && spill(f) == -1)
+        return -1;
+
+    FAT_entry current = fat_get(cur = f->start);
+    for (i = 1; i < n; i++){
+        if (current.next != BLOCKSIZE){
+            current = fat_get(cur = current.next);
+            continue;}
+        if ((cur = chain_extend(cur, 0)) == -1)
+            return -1;
+        current = fat_get(cur);
+        current.data = DATA_HOLE;
+        fat_set(cur, current);
+    }
+    return cur;
+}
+
+// Drop any cached copy of a block whose contents are being replaced
+// behind the cache's back
+static void cache_drop(int block){
+    int i;
+
+    for (i = 0; i < CACHE_PAGES; i++){
+        if (fs->cache[i].block == block && fs->cache[i].pins == 0)
+            fs->cache[i].block = -1;
+    }
+}
+
+// Reserve blocks for length bytes of the file from offset, so writing
+// there later needs no allocation, and grow the file to cover them. The
+// blocks missing are found in one pass, as a single run if the disk has
+// one, which the block an inline file has just spilled to moves into too.
+// Compressed, dedup and log volumes can't set space aside, as their
+// blocks move when written, so there the file is only grown. Negative
+// return value => invalid file ID or range, or not enough space.
+int sfs_fallocate_r(sfs_t *h, int fileID, int offset, int length){
+    fs = h;
+    open_file *f = get_file(fileID);
+
+    if (f == NULL || offset < 0 || length <= 0 || offset + length < offset)
+        return -1;
+
+    unsigned int end = offset + length;
+    int first = offset / BLOCKSIZE, last = (end - 1) / BLOCKSIZE;
+    int n = 0, i, cur, b;
+
+    if (f->start == BLOCKSIZE && end <= INLINE_MAX){
+        if (end > f->size)
+            file_resize(f, end);
+        return 0;}
+
+    int spilled = f->start == BLOCKSIZE;
+    if (chain_cover(f, last + 1) == -1)
+        return -1;
+    if (fs->sfs_flags & (SFS_COMPRESS | SFS_DEDUP | SFS_LOG)){
+        if (end > f->size)
+            file_resize(f, end);
+        return 0;}
+
+    // FAT entries of the range that have no block yet
+    int *need = malloc((last - first + 1) * sizeof(int));
+    if (!need)
+        return -1;
+
+    FAT_entry current = fat_get(cur = f->start);
+    for (i = 0; i <= last; i++){
+        if (i >= first && (current.data >= BLOCKSIZE || (i == 0 && spilled)))
+            need[n++] = cur;
+        if (i < last)
+            current = fat_get(cur = current.next);
+    }
+
+    b = n > 0 ? free_run(n) : -1;
+    for (i = 0; i < n; i++){
+        current = fat_get(need[i]);
+        if (b == -1 && current.data < BLOCKSIZE)
+            continue;
+        int to = b != -1 ? b + i : first_open();
+        if (to == -1)
+            break;
+        set_used(to);
+
+        // Reserved blocks read back as zeros until written, and a spilled
+        // block brings what it holds
+        cache_drop(DATA_START + to);
+        block_write(DATA_START + to, current.data < BLOCKSIZE ? data_get(current) : zero_block);
+        data_release(current);
+
+        current.data = to;
+        current.frag = 0;
+        current.nfrag = FRAGS;
+        fat_set(need[i], current);
+    }
+    free(need);
+
+    if (i < n)
+        return -1;
+    if (end > f->size)
+        file_resize(f, end);
+    return 0;
+}
+
+// Set the size of the file to length bytes. Blocks past the new end are
+// freed together; growing the file adds a hole. Negative return value =>
+// invalid file ID or length.
+int sfs_ftruncate_r(sfs_t *h, int fileID, int length){
+    fs = h;
+    open_file *f = get_file(fileID);
+
+    if (f == NULL || length < 0)
+        return -1;
+    if (length == f->size)
+        return 0;
+
+    if (f->start == BLOCKSIZE && length <= INLINE_MAX){
+        directory_entry e;
+        if (fd_entry(f, &e) == -1)
+            return -1;
+        if (length < f->size)
+            memset(e.data + length, 0, INLINE_MAX - length);
+        e.size = f->size = length;
+        dir_update(f->parent, f->slot, e);
+        return 0;
+    }
+
+    if (length > f->size){
+        if (chain_cover(f, (length + BLOCKSIZE - 1) / BLOCKSIZE) == -1)
+            return -1;
+        file_resize(f, length);
+        return 0;
+    }
+
+    if (length == 0){
+        chain_free(f->start);
+        f->start = BLOCKSIZE;
+        file_resize(f, 0);
+        discard_flush();
+        return 0;
+    }
+
+    int cur = chain_cover(f, (length + BLOCKSIZE - 1) / BLOCKSIZE);
+    if (cur == -1)
+        return -1;
+    FAT_entry current = fat_get(cur);
+
+    // Clear what is left past the end in the last block, so growing the
+    // file again reads zeros there. This is done before the chain is cut,
+    // so a write that fails (a shared block with no room for its copy)
+    // leaves the file as it was.
+    if (length % BLOCKSIZE && current.data != DATA_HOLE){
+        int end = length - length % BLOCKSIZE + BLOCKSIZE;
+        struct iovec iov = {.iov_base = (char *) zero_block,
+                            .iov_len = (end < f->size ? end : f->size) - length};
+        if (file_io(f, length, &iov, 1, 1) != (int) iov.iov_len)
+            return -1;
+        current = fat_get(cur);}
+
+    chain_free(current.next);
+    current.next = BLOCKSIZE;
+    fat_set(cur, current);
+    file_resize(f, length);
+    discard_flush();
+    return 0;
+}
+
+// Negative return value => file not found, still open or mapped, or a
+// directory that isn't empty
+int sfs_remove_r(sfs_t *h, char *file){
+    fs = h;
+    unsigned short parent;
+    char name[MAX_FNAME_LENGTH + 1];
+    directory_entry e;
+    int slot = 0;
+
+    if (!fs || resolve(file, &parent, name) == -1
+        || dir_lookup(parent, name, &e, &slot) == -1)
+        return -1;
+
+    if (e.type == TYPE_DIR){
+        dir_node root;
+        node_read(e.indx, 0, &root);
+        if (root.entries != 0)
+            return -1;}
+
+    // An open descriptor or a mapping still writes to the file's blocks
+    if (file_find(parent, name) != -1)
+        return -1;
+
+    dir_remove(parent, name, slot);
+    chain_free(e.indx);
+    discard_flush();
+    return 0;
+}
+
+// Make dst a copy of the file or directory src. The copy shares src's data
+// blocks, and a block is only copied once either side writes to it.
+// Negative return value => src missing, dst taken or metadata full
+int sfs_clone_r(sfs_t *h, char *src, char *dst){
+    fs = h;
+    unsigned short parent;
+    char name[MAX_FNAME_LENGTH + 1];
+    directory_entry e, old;
+
+    if (!fs){
+        fprintf(stderr,
+            "Error in sfs_clone.\nFile system neads to be opened first");
+        return -1;}
+
+    // Fragments have no reference counts of their own
+    if (fs->sfs_flags & SFS_COMPRESS){
+        fprintf(stderr, "Clones are not supported on compressed volumes");
+        return -1;}
+
+    if (resolve(src, &parent, name) == -1 || dir_lookup(parent, name, &e, NULL) == -1
+        || resolve(dst, &parent, name) == -1 || dir_lookup(parent, name, &old, NULL) == 0)
+        return -1;
+
+    if (entry_clone(&e, BLOCKSIZE) == -1)
+        return -1;
+    strncpy(e.name, name, MAX_FNAME_LENGTH + 1);
+    if (dir_insert(parent, e, NULL) == -1){
+        entry_free(e);
+        return -1;}
+    return 0;
+}
+
+// Create directory path holding a clone of everything on the volume as it
+// is now. Only metadata is copied; data blocks are shared as by sfs_clone.
+int sfs_snapshot_r(sfs_t *h, char *path){
+    fs = h;
+    unsigned short parent;
+    char name[MAX_FNAME_LENGTH + 1];
+    directory_entry snap;
+    int i, slot = 0;
+
+    if (!fs){
+        fprintf(stderr,
+            "Error in sfs_snapshot.\nFile system neads to be opened first");
+        return -1;}
+
+    if (fs->sfs_flags & SFS_COMPRESS){
+        fprintf(stderr, "Snapshots are not supported on compressed volumes");
+        return -1;}
+
+    if (resolve(path, &parent, name) == -1 || dir_lookup(parent, name, &snap, NULL) == 0)
+        return -1;
+
+    int dir = dir_new();
+    if (dir == -1)
+        return -1;
+
+    // Entered first so that the walk below finds it and leaves it out
+    memset(&snap, 0, sizeof(snap));
+    strncpy(snap.name, name, MAX_FNAME_LENGTH + 1);
+    snap.type = TYPE_DIR;
+    snap.indx = dir;
+    if (dir_insert(parent, snap, &slot) == -1){
+        chain_free(dir);
+        return -1;}
+
+    for (i = 0; i < fs->dir_hwm; i++){
+        directory_entry e = dir_get(i);
+        if (e.name[0] == '\0' || (e.type == TYPE_DIR && e.indx == dir))
+            continue;
+        if (entry_clone(&e, dir) == -1)
+            break;
+        if (dir_insert(dir, e, NULL) == -1){
+            entry_free(e);
+            break;}
+    }
+
+    if (i < fs->dir_hwm){
+        // Out of room: don't leave half a snapshot behind
+        dir_remove(parent, name, slot);
+        entry_free(snap);
+        return -1;}
+    return 0;
+}
+
+// Whether a view has block pinned in the cache
+static int is_pinned(int block){
+    int i;
+
+    for (i = 0; i < CACHE_PAGES; i++){
+        if (fs->cache[i].block == block && fs->cache[i].pins > 0)
+            return 1;
+    }
+    return 0;
+}
+
+// First data block of n consecutive free ones, or -1
+static int free_run(int n){
+    unsigned int *buff = (unsigned int *) cache_block(FREE_LIST);
+    int b, len = 0;
+
+    for (b = 0; b < BLOCKSIZE; b++){
+        if (buff[b / 32] & 1u << (b % 32))
+            len = 0;
+        else if (++len == n)
+            return b - n + 1;
+    }
+    return -1;
+}
+
+// Copy the block behind FAT entry k to the free block to and repoint the
+// entry. The old block is only released once nothing refers to it.
+static int block_move(int k, FAT_entry *e, int to){
+    char buf[BLOCKSIZE];
+    int from = e->data;
+
+    fs->io_error = 0;
+    memcpy(buf, cache_block(DATA_START + from), BLOCKSIZE);
+    if (fs->io_error)
+        return -1;
+
+    char *page = cache_lookup(DATA_START + to, 0)->data;
+    memcpy(page, buf, BLOCKSIZE);
+    block_write(DATA_START + to, page);
+    set_used(to);
+
+    block_ref r = ref_get(from);
+    if (r.hash){
+        dedup_unlink(from, r.hash);
+        ref_set(to, r);
+        dedup_link(to, r.hash);
+        ref_set(from, (block_ref) {0, 0});}
+
+    e->data = to;
+    fat_set(k, *e);
+    set_unused(from);
+    return 0;
+}
+
+// Move the file starting at FAT entry start into a contiguous run of free
+// blocks, as far as the limit allows. Returns 1 if it stopped part way.
+static int defrag_chain(int start){
+    unsigned short blocks[BLOCKSIZE];
+    int n = 0, i, cur, pos = fs->defrag_pos;
+
+    fs->defrag_pos = 0;
+
+    // Files already in one piece, sparse ones, and blocks that are shared,
+    // compressed or pinned by a view, are left alone
+    for (cur = start; cur != BLOCKSIZE; cur = fat_get(cur).next){
+        FAT_entry e = fat_get(cur);
+        if (n == BLOCKSIZE || e.data >= BLOCKSIZE || !is_whole(e) || is_shared(e)
+            || is_pinned(DATA_START + e.data))
+            return 0;
+        blocks[n++] = e.data;
+    }
+    for (i = 1; i < n && blocks[i] == blocks[0] + i; i++)
+        ;
+    if (i >= n)
+        return 0;
+
+    // Carry on into the run an earlier call started only if the part
+    // already moved is still there and nobody has taken the rest
+    if (pos > 0){
+        unsigned int *buff = (unsigned int *) cache_block(FREE_LIST);
+        for (i = 0; i < n; i++){
+            int b = fs->defrag_run + i;
+            if (b >= BLOCKSIZE || (i < pos ? blocks[i] != b
+                                           : (buff[b / 32] & 1u << (b % 32)) != 0))
+                break;
+        }
+        if (i < n)
+            pos = 0;
+    }
+    if (pos == 0 && (fs->defrag_run = free_run(n)) == -1)
+        return 0;
+
+    for (cur = start, i = 0; i < pos; i++)
+        cur = fat_get(cur).next;
+
+    for (; pos < n; pos++){
+        if (fs->defrag_limit > 0 && fs->defrag_moved == fs->defrag_limit){
+            fs->defrag_pos = pos;
+            return 1;}
+
+        FAT_entry e = fat_get(cur);
+        if (block_move(cur, &e, fs->defrag_run + pos) == -1)
+            return 0;
+        fs->defrag_moved++;
+        cur = e.next;
+    }
+    return 0;
+}
+
+// Mark in heads the FAT entry each file below node n of directory dir
+// starts at. A pass takes files in that order, so where it stopped holds
+// however files are created and removed between calls.
+static void defrag_tree(unsigned short dir, int n, unsigned int *heads);
+
+static void defrag_mark(directory_entry e, unsigned int *heads){
+    if (e.type == TYPE_DIR)
+        defrag_tree(e.indx, 0, heads);
+    else if (e.indx != BLOCKSIZE)
+        heads[e.indx / 32] |= 1u << (e.indx % 32);
+}
+
+static void defrag_tree(unsigned short dir, int n, unsigned int *heads){
+    dir_node node;
+    int i;
+
+    node_read(dir, n, &node);
+    for (i = 0; i <= node.count; i++){
+        if (node.internal)
+            defrag_tree(dir, node.child[i], heads);
+        if (i < node.count)
+            defrag_mark(node.entry[i], heads);
+    }
+}
+
+// Rewrite fragmented files into contiguous runs of blocks, moving at most
+// max_blocks blocks per call (no limit if max_blocks <= 0). Work resumes
+// where the previous call stopped, so it can be run a little at a time
+// while the volume is in use. Returns the number of blocks moved; 0 once
+// a whole pass finds nothing left to do.
+int sfs_defrag_r(sfs_t *h, int max_blocks){
+    fs = h;
+    unsigned int heads[FAT_ENTRIES / 32];
+    int i, k;
+
+    if (!fs){
+        fprintf(stderr,
+            "Error in sfs_defrag.\nFile system neads to be opened first");
+        return -1;}
+
+    fs->defrag_moved = 0;
+    fs->defrag_limit = max_blocks > 0 ? max_blocks : 0;
+
+    memset(heads, 0, sizeof(heads));
+    for (i = 0; i < fs->dir_hwm; i++){
+        directory_entry e = dir_get(i);
+        if (e.name[0] != '\0')
+            defrag_mark(e, heads);
+    }
+
+    // A file removed part way through leaves nothing to carry on with
+    k = fs->defrag_start;
+    if (!(heads[k / 32] & 1u << (k % 32)))
+        fs->defrag_pos = 0;
+    for (; k < FAT_ENTRIES; k++){
+        if ((heads[k / 32] & 1u << (k % 32)) && defrag_chain(k))
+            break;
+    }
+
+    // Finished the pass; the next call starts another
+    fs->defrag_start = k < FAT_ENTRIES ? k : 0;
+    discard_flush();
+    return fs->defrag_moved;
+}
+
+/*
+ * Log volumes never rewrite a data block in place: data_put appends the
+ * new contents at the head of the log and frees the old block, and the FAT
+ * records where each block now lives. The log fills one segment after
+ * another, starting each time on the emptiest one, so small writes
+ * scattered over files reach the disk one after the other. The cleaner
+ * keeps empty segments coming by moving what is still live out of the
+ * segments with the least of it.
+ */
+
+// Data blocks of segment seg that are in use, one bit each
+static unsigned int seg_used(int seg){
+    return ((unsigned int *) cache_block(FREE_LIST))[seg];
+}
+
+// Next free data block at the head of the log, moving on to the emptiest
+// other segment when this one is full. -1 if the disk is full.
+static int log_alloc(){
+    int seg, best = -1, most = 0, i;
+
+    for (;;){
+        while (fs->log_seg != -1 && fs->log_head < (fs->log_seg + 1) * LOG_SEGMENT){
+            int b = fs->log_head++;
+            if (!(seg_used(fs->log_seg) & 1u << b % LOG_SEGMENT))
+                return b;
+        }
+        if (best != -1)
+            return first_open();    // only the segment being cleaned has room
+
+        // Carry on from the segment just filled, so the log sweeps the disk
+        for (i = 1; i <= LOG_SEGMENTS; i++){
+            seg = (fs->log_seg + i + LOG_SEGMENTS) % LOG_SEGMENTS;
+            int free = LOG_SEGMENT - __builtin_popcount(seg_used(seg));
+            if (seg != fs->log_victim && free > most){
+                best = seg;
+                most = free;}
+        }
+        if (best == -1)
+            return first_open();
+        fs->log_seg = best;
+        fs->log_head = best * LOG_SEGMENT;
+    }
+}
+
+// Find the FAT entry owning each data block
+static void log_load(){
+    int k;
+
+    for (k = 0; k < FAT_ENTRIES; k++){
+        FAT_entry e = fat_get(k);
+        if (e.data < BLOCKSIZE)
+            fs->log_owner[e.data] = k;
+    }
+}
+
+// Pick the segment with the least live data to clean next
+static int log_pick(){
+    int seg, fewest = LOG_SEGMENT;
+
+    fs->log_victim = -1;
+    for (seg = 0; seg < LOG_SEGMENTS; seg++){
+        int live = __builtin_popcount(seg_used(seg));
+        if (seg != fs->log_seg && live > 0 && live < fewest && !(fs->log_skip >> seg & 1)){
+            fs->log_victim = seg;
+            fewest = live;}
+    }
+    if (fs->log_victim == -1){
+        fs->log_skip = 0;
+        return -1;}
+    return 0;
+}
+
+// Move up to max live blocks out of the segments being cleaned, while
+// fewer than LOG_RESERVE segments are clean. On a disk too full for that,
+// stop once as many are clean as its free blocks could fill, as moving
+// more can't gain one.
+static void log_clean(int max){
+    int seg, clean = 0, want = free_blocks() / LOG_SEGMENT;
+
+    if (want > LOG_RESERVE)
+        want = LOG_RESERVE;
+    for (seg = 0; seg < LOG_SEGMENTS; seg++)
+        clean += seg_used(seg) == 0;
+
+    while (max > 0 && clean < want){
+        if (fs->log_victim == -1 || seg_used(fs->log_victim) == 0){
+            if (fs->log_victim != -1)
+                clean++;
+            if (clean >= want || log_pick() == -1)
+                break;
+        }
+
+        int i = __builtin_ctz(seg_used(fs->log_victim));
+        int b = fs->log_victim * LOG_SEGMENT + i, k = fs->log_owner[b];
+        FAT_entry e = fat_get(k);
+        int to;
+
+        // Leave behind what can't be moved, or whose owner isn't known,
+        // and the segment with it
+        if (e.data != b || !is_whole(e) || is_shared(e) || is_pinned(DATA_START + b)
+            || (to = log_alloc()) == -1 || block_move(k, &e, to) == -1){
+            fs->log_skip |= 1ULL << fs->log_victim;
+            fs->log_victim = -1;
+            continue;}
+        max--;
+    }
+}
+
+// A file or directory found by sfs_fsck, and what walking its chain found
+typedef struct fsck_obj {
+    directory_entry e;
+    unsigned short parent;  // directory holding it, ROOT_DIR for the root
+    unsigned short slot;    // root directory slot when parent is ROOT_DIR
+    int nodes;              // directories: nodes recorded in node 0
+    int blocks;             // entries in the chain
+    int cut;                // last good entry before a bad link, -1 for
+                            // the head, -2 if the chain is sound
+    int fault;              // FSCK_* describing the bad link
+} fsck_obj;
+
+#define FSCK_LINK 1     // chain runs into a free or out of range entry
+#define FSCK_CYCLE 2    // chain loops back on itself
+#define FSCK_CROSS 3    // chain joins another file's chain
+
+// Everything a check pass knows about the volume
+typedef struct fsck_state {
+    FAT_entry *fat;         // decoded copy of the whole FAT
+    int *owner;             // object whose chain holds each FAT entry, or -1
+    int *uses;              // chains referencing each whole data block
+    unsigned char *frags;   // fragments of each data block claimed by chains
+    unsigned char *clash;   // data blocks claimed twice over
+    fsck_obj *objs;
+    int nobjs, cap;
+    int next;               // next object for a worker to walk
+} fsck_state;
+
+static const char *fsck_faults[] = {"", "bad link", "cycle", "cross-linked"};
+
+static void fsck_say(const char *fmt, ...){
+    va_list ap;
+
+    if (!fs->fsck_verbose)
+        return;
+    va_start(ap, fmt);
+    printf("fsck: ");
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+// Walk the chain of object id, claiming its FAT entries and data blocks.
+// Runs on several threads at once, so the shared tables are only touched
+// atomically.
+static void fsck_walk(fsck_state *st, int id){
+    fsck_obj *o = &st->objs[id];
+    int k = o->e.indx, prev = -1;
+
+    o->blocks = 0;
+    o->cut = -2;
+    while (k != BLOCKSIZE){
+        int expect = -1;
+
+        if (k >= FAT_ENTRIES || st->fat[k].data == BLOCKSIZE
+            || (st->fat[k].data > BLOCKSIZE && st->fat[k].data != DATA_PENDING
+                && st->fat[k].data != DATA_HOLE)){
+            o->fault = FSCK_LINK;
+            o->cut = prev;
+            return;}
+        if (!__atomic_compare_exchange_n(&st->owner[k], &expect, id, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+            o->fault = expect == id ? FSCK_CYCLE : FSCK_CROSS;
+            o->cut = prev;
+            return;}
+
+        FAT_entry e = st->fat[k];
+        if (e.data < BLOCKSIZE && is_whole(e)){
+            __atomic_add_fetch(&st->uses[e.data], 1, __ATOMIC_RELAXED);
+        } else if (e.data < BLOCKSIZE){
+            unsigned char bits = ((1 << e.nfrag) - 1) << e.frag;
+            if (e.frag + e.nfrag > FRAGS
+                || __atomic_fetch_or(&st->frags[e.data], bits, __ATOMIC_RELAXED) & bits)
+                __atomic_store_n(&st->clash[e.data], 1, __ATOMIC_RELAXED);
+        }
+        o->blocks++;
+        prev = k;
+        k = e.next;
+    }
+}
+
+static void *fsck_worker(void *arg){
+    fsck_state *st = arg;
+    int id;
+
+    while ((id = __atomic_fetch_add(&st->next, 1, __ATOMIC_RELAXED)) < st->nobjs)
+        fsck_walk(st, id);
+    return NULL;
+}
+
+static int fsck_add(fsck_state *st, directory_entry e, unsigned short parent, int slot){
+    if (st->nobjs == st->cap){
+        int cap = st->cap ? 2 * st->cap : 256;
+        fsck_obj *objs = realloc(st->objs, cap * sizeof(fsck_obj));
+        if (!objs)
+            return -1;
+        st->objs = objs;
+        st->cap = cap;}
+
+    fsck_obj *o = &st->objs[st->nobjs++];
+    memset(o, 0, sizeof(*o));
+    o->e = e;
+    o->parent = parent;
+    o->slot = slot;
+    return 0;
+}
+
+// Record every entry below node n of directory dir, and the entries of
+// the directories among them
+static int fsck_collect(fsck_state *st, unsigned short dir, int n, int depth){
+    dir_node node;
+    int i;
+
+    // A damaged tree could point anywhere, including back up at itself
+    if (depth > 32 || n > FAT_ENTRIES || (n > 0 && st->fat[n - 1].data >= BLOCKSIZE))
+        return 0;
+
+    node_read(dir, n, &node);
+    if (node.count > DIR_KEYS)
+        return 0;
+    for (i = 0; i <= node.count; i++){
+        if (node.internal && fsck_collect(st, dir, node.child[i], depth + 1) == -1)
+            return -1;
+        if (i == node.count)
+            break;
+        if (fsck_add(st, node.entry[i], dir, 0) == -1)
+            return -1;
+        if (node.entry[i].type == TYPE_DIR){
+            dir_node root;
+            fsck_obj *o = &st->objs[st->nobjs - 1];
+            if (node.entry[i].indx >= FAT_ENTRIES)
+                continue;
+            node_read(node.entry[i].indx, 0, &root);
+            o->nodes = root.nodes;
+            if (fsck_collect(st, node.entry[i].indx, 0, depth + 1) == -1)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// One check of the whole volume, fixing what it can if repair is set.
+// Returns the number of problems found.
+static int fsck_pass(int repair){
+    fsck_state st;
+    int meta = DATA_START - FREE_LIST, problems = 0, cuts = 0, i, b;
+    char *img = malloc(meta * BLOCKSIZE);
+
+    memset(&st, 0, sizeof(st));
+    st.fat = malloc(FAT_ENTRIES * sizeof(FAT_entry));
+    st.owner = malloc(FAT_ENTRIES * sizeof(int));
+    st.uses = calloc(BLOCKSIZE, sizeof(int));
+    st.frags = calloc(BLOCKSIZE, 1);
+    st.clash = calloc(BLOCKSIZE, 1);
+    if (!img || !st.fat || !st.owner || !st.uses || !st.frags || !st.clash){
+        fprintf(stderr, "Error in malloc at sfs_fsck");
+        problems = -1;
+        goto out;}
+
+    // Once everything is written back the disk is current. Read all the
+    // metadata in one go rather than a block at a time through the cache.
+    wb_sync();
+    if (disk_read(fs->disk, FREE_LIST, meta, img) != meta){
+        // Find the damaged blocks, and go on with what they hold
+        for (i = 0; i < meta; i++){
+            if (disk_read(fs->disk, FREE_LIST + i, 1, img + i * BLOCKSIZE) == 1)
+                continue;
+            fsck_say("metadata block %d is damaged\n", FREE_LIST + i);
+            problems++;
+            if (repair)
+                block_write(FREE_LIST + i, img + i * BLOCKSIZE);
+        }
+    }
+
+    unsigned int *bitmap = (unsigned int *) img;
+    unsigned char *fragmap = (unsigned char *) img + FRAG_MAP;
+    directory_entry *root = (directory_entry *) (img + (ROOT_LOC - FREE_LIST) * BLOCKSIZE);
+    unsigned short *raw = (unsigned short *) (img + (FAT_LOC - FREE_LIST) * BLOCKSIZE);
+    block_ref *refs = (block_ref *) (img + (REF_LOC - FREE_LIST) * BLOCKSIZE);
+
+    for (i = 0; i < FAT_ENTRIES; i++){
+        st.fat[i] = fat_decode(raw + 2 * i);
+        st.owner[i] = -1;}
+
+    for (i = 0; i < fs->dir_hwm; i++){
+        directory_entry e = root[i];
+        if (e.name[0] == '\0')
+            continue;
+        e.indx = from_disk(e.indx);
+        if (fsck_add(&st, e, ROOT_DIR, i) == -1){
+            problems = -1;
+            goto out;}
+        if (e.type == TYPE_DIR && e.indx < FAT_ENTRIES){
+            dir_node node;
+            node_read(e.indx, 0, &node);
+            st.objs[st.nobjs - 1].nodes = node.nodes;
+            if (fsck_collect(&st, e.indx, 0, 0) == -1){
+                problems = -1;
+                goto out;}
+        }
+    }
+
+    // Walk the chains in parallel
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int nthreads = cpus < 1 ? 1 : cpus > 8 ? 8 : cpus;
+    pthread_t threads[8];
+
+    if (nthreads > st.nobjs / 64 + 1)
+        nthreads = st.nobjs / 64 + 1;
+    for (i = 1; i < nthreads; i++){
+        if (pthread_create(&threads[i], NULL, fsck_worker, &st) != 0)
+            break;}
+    nthreads = i;
+    fsck_worker(&st);
+    for (i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    // Files and directories
+    for (i = 0; i < st.nobjs; i++){
+        fsck_obj *o = &st.objs[i];
+        directory_entry e = o->e;
+        unsigned int need = (e.size + BLOCKSIZE - 1) / BLOCKSIZE;
+
+        if (o->cut != -2){
+            fsck_say("%s: %s after %d blocks\n", e.name, fsck_faults[o->fault], o->blocks);
+            problems++;
+            if (repair && o->cut >= 0){
+                FAT_entry last = fat_get(o->cut);
+                last.next = BLOCKSIZE;
+                fat_set(o->cut, last);
+            } else if (repair && e.type == TYPE_FILE){
+                e.indx = BLOCKSIZE;
+                e.size = 0;
+                dir_update(o->parent, o->slot, e);
+            }
+            cuts++;
+        }
+
+        if (e.type == TYPE_DIR){
+            if (o->blocks < o->nodes){
+                fsck_say("%s: directory has %d of its %d nodes\n", e.name, o->blocks, o->nodes);
+                problems++;}
+        } else if (e.indx == BLOCKSIZE ? e.size > INLINE_MAX : o->blocks < need){
+            fsck_say("%s: size %u but %d blocks\n", e.name, e.size, o->blocks);
+            problems++;
+            if (repair){
+                e.size = e.indx == BLOCKSIZE ? INLINE_MAX : o->blocks * BLOCKSIZE;
+                dir_update(o->parent, o->slot, e);}
+        }
+    }
+
+    // Block accounting is only fixed once the chains are sound, as cutting
+    // a chain changes which blocks are in use
+    repair = repair && cuts == 0;
+
+    for (i = 0; i < FAT_ENTRIES; i++){
+        if (i == BLOCKSIZE || st.fat[i].data == BLOCKSIZE || st.owner[i] != -1)
+            continue;
+        fsck_say("FAT entry %d leaked\n", i);
+        problems++;
+        if (repair)
+            fat_set(i, (FAT_entry) {.data = BLOCKSIZE, .next = BLOCKSIZE});
+    }
+
+    for (b = 0; b < BLOCKSIZE; b++){
+        int used = (bitmap[b / 32] >> (b % 32)) & 1;
+        int frags = (fs->sfs_flags & SFS_COMPRESS) ? (fragmap[b / 2] >> (b % 2 * 4)) & 0xF : 0;
+        int in_use = st.uses[b] > 0 || st.frags[b] != 0;
+        unsigned int want = st.uses[b] > 1 ? st.uses[b] - 1 : 0;
+
+        if (st.clash[b] || (st.uses[b] > 0 && st.frags[b] != 0)){
+            fsck_say("block %d allocated more than once\n", b);
+            problems++;}
+
+        if (in_use && !used){
+            fsck_say("block %d in use but marked free\n", b);
+            problems++;
+            if (repair)
+                set_used(b);
+        } else if (!in_use && used){
+            fsck_say("block %d leaked\n", b);
+            problems++;
+            if (repair){
+                set_unused(b);
+                ref_set(b, (block_ref) {0, 0});}
+        }
+
+        if (in_use && !st.clash[b] && refs[b].refs != want){
+            fsck_say("block %d has %u extra owners recorded, %u found\n",
+                   b, refs[b].refs, want);
+            problems++;
+            if (repair){
+                block_ref r = refs[b];
+                r.refs = want;
+                ref_set(b, r);}
+        }
+
+        if (!st.clash[b] && frags != st.frags[b]){
+            fsck_say("block %d fragment map is %x, should be %x\n", b, frags, st.frags[b]);
+            problems++;
+            if (repair)
+                frag_mark(b, st.frags[b]);
+        }
+    }
+
+out:
+    free(img);
+    free(st.fat);
+    free(st.owner);
+    free(st.uses);
+    free(st.frags);
+    free(st.clash);
+    free(st.objs);
+    return problems;
+}
+
+// Check the mounted volume: every directory entry and FAT chain against
+// the free list, reference counts and fragment map. With repair set,
+// broken chains are cut short, sizes trimmed to fit, and leaked or
+// unmarked blocks and FAT entries fixed. Returns the number of problems
+// found, or -1 if the check couldn't run; check again to see what a
+// repair left.
+int sfs_fsck_r(sfs_t *h, int repair){
+    fs = h;
+    int i, problems;
+
+    if (!fs){
+        fprintf(stderr,
+            "Error in sfs_fsck.\nFile system neads to be opened first");
+        return -1;}
+
+    // Open files hold chain starts and sizes a repair could change
+    for (i = 0; repair && i < fs->nfiles; i++){
+        if (fs->files[i].refs > 0){
+            fprintf(stderr, "Error in sfs_fsck.\nClose all files before a repair");
+            return -1;}
+    }
+
+    fs->fsck_verbose = 1;
+    problems = fsck_pass(repair);
+    if (repair && problems > 0){
+        // A second pass fixes block accounting after chains were cut
+        fs->fsck_verbose = 0;
+        fsck_pass(1);
+        if (fs->sfs_flags & SFS_DEDUP)
+            dedup_load();
+    }
+    discard_flush();
+    return problems;
+}
+
+// Whether SFS_DIRECT took effect, as it only does where the host can
+// bypass its page cache for the image
+int sfs_direct_r(sfs_t *h){
+    return h ? h->direct : -1;
+}
+
+// Cache misses served from the blocks read back after mount
+int sfs_warm_hits_r(sfs_t *h){
+    return h ? h->warm_hits : -1;
+}
+
+// Count the data blocks not in use
+int sfs_free_blocks_r(sfs_t *h){
+    fs = h;
+
+    if (!fs)
+        return -1;
+    return free_blocks();
+}
+
+// Data blocks not in use
+static int free_blocks(){
+    unsigned int *buff = (unsigned int *) cache_block(FREE_LIST);
+    int i, used = 0;
+
+    for (i = 0; i < BLOCKSIZE/(8*sizeof(unsigned int)); i++)
+        used += __builtin_popcount(buff[i]);
+    return BLOCKSIZE - used;
+}
+
+// Get the value of the first available unused spot
+int first_open(){
+    unsigned int *buff = (unsigned int *) cache_block(FREE_LIST);
+
+    int i;
+    for (i = 0; i < BLOCKSIZE/(8*sizeof(unsigned int)); i++){
+        int f = ffs(~buff[i]);  // 1 = allocated, so a zeroed list is all free
+        if (f){
+            return f + i*8*sizeof(unsigned int) -1;
+        }
+    }
+
+    return -1;
+}
+
+// Set indx to allocated
+void set_used(unsigned short indx){
+    int i = indx/(8*sizeof(unsigned int));   // where in bit array to flip
+    int j = indx % (8*sizeof(unsigned int)); //  which bit to flip
+    unsigned int *buff = (unsigned int *) cache_block(FREE_LIST);
+
+    buff[i] |= 1 << j;
+    block_write(FREE_LIST, (char *) buff);
+    fs->discard[i] &= ~(1 << j);
+}
+
+// Set indx to free
+void set_unused(unsigned short indx){
+    int i = indx/(8*sizeof(unsigned int));   // where in bit array to flip
+    int j = indx % (8*sizeof(unsigned int)); // which bit to flip
+    unsigned int *buff = (unsigned int *) cache_block(FREE_LIST);
+
+    buff[i] &= ~(1 << j);
+    block_write(FREE_LIST, (char *) buff);
+    fs->discard[i] |= 1 << j;
+}
+
+// Have the disk discard the data blocks freed since the last call, a run
+// at a time, so the image stops taking up host space for them. Blocks
+// taken again in the meantime are already off the list.
+static void discard_flush(){
+    int b = 0, n;
+
+    while (b < BLOCKSIZE){
+        if (fs->discard[b / 32] == 0){
+            b += 32;
+            continue;}
+        for (n = 0; b + n < BLOCKSIZE && fs->discard[(b + n) / 32] & 1u << (b + n) % 32; n++)
+            ;
+        if (n > 0){
+            wb_forget(DATA_START + b, n);
+            disk_discard(fs->disk, DATA_START + b, n);}
+        b += n ? n : 1;
+    }
+    memset(fs->discard, 0, sizeof(fs->discard));
+}
+
+// The original calls, working on the volume mounted at FILENAME by mksfs
+
+int mksfs(int fresh){
+    return mksfs_opts(fresh, 0);
+}
+
+// Like mksfs, but a fresh file system is formatted with the given
+// SFS_* options
+int mksfs_opts(int fresh, int flags){
+    sfs_unmount(default_fs);
+    default_fs = sfs_mount(FILENAME, flags | (fresh ? SFS_FORMAT : 0));
+    return default_fs ? 0 : -1;
+}
+
+void sfs_ls(void){
+    sfs_ls_r(default_fs);
+}
+
+int sfs_fopen(char *name){
+    return sfs_fopen_r(default_fs, name);
+}
+
+int sfs_fclose(int fileID){
+    return sfs_fclose_r(default_fs, fileID);
+}
+
+int sfs_fwrite(int fileID, char *buf, int length){
+    return sfs_fwrite_r(default_fs, fileID, buf, length);
+}
+
+int sfs_fread(int fileID, char *buf, int length){
+    return sfs_fread_r(default_fs, fileID, buf, length);
+}
+
+int sfs_fseek(int fileID, int offset){
+    return sfs_fseek_r(default_fs, fileID, offset);
+}
+
+int sfs_fsize(int fileID){
+    return sfs_fsize_r(default_fs, fileID);
+}
+
+int sfs_fallocate(int fileID, int offset, int length){
+    return sfs_fallocate_r(default_fs, fileID, offset, length);
+}
+
+int sfs_ftruncate(int fileID, int length){
+    return sfs_ftruncate_r(default_fs, fileID, length);
+}
+
+int sfs_remove(char *file){
+    return sfs_remove_r(default_fs, file);
+}
+
+int sfs_mkdir(char *path){
+    return sfs_mkdir_r(default_fs, path);
+}
+
+int sfs_lsdir(char *path){
+    return sfs_lsdir_r(default_fs, path);
+}
+
+int sfs_clone(char *src, char *dst){
+    return sfs_clone_r(default_fs, src, dst);
+}
+
+int sfs_snapshot(char *path){
+    return sfs_snapshot_r(default_fs, path);
+}
+
+int sfs_defrag(int max_blocks){
+    return sfs_defrag_r(default_fs, max_blocks);
+}
+
+int sfs_fsck(int repair){
+    return sfs_fsck_r(default_fs, repair);
+}
+
+int sfs_free_blocks(void){
+    return sfs_free_blocks_r(default_fs);
+}
+
+int sfs_direct(void){
+    return sfs_direct_r(default_fs);
+}
+
+int sfs_warm_hits(void){
+    return sfs_warm_hits_r(default_fs);
+}
+
+int sfs_freadv(int fileID, const struct iovec *iov, int iovcnt, int offset){
+    return sfs_freadv_r(default_fs, fileID, iov, iovcnt, offset);
+}
+
+int sfs_fwritev(int fileID, const struct iovec *iov, int iovcnt, int offset){
+    return sfs_fwritev_r(default_fs, fileID, iov, iovcnt, offset);
+}
+
+int sfs_fread_view(int fileID, int offset, int length, sfs_view *view){
+    return sfs_fread_view_r(default_fs, fileID, offset, length, view);
+}
+
+void sfs_release_view(sfs_view *view){
+    sfs_release_view_r(default_fs, view);
+}
+
+void *sfs_mmap(int fileID, int offset, int length, int flags){
+    return sfs_mmap_r(default_fs, fileID, offset, length, flags);
+}
+
+int sfs_msync(void *addr){
+    return sfs_msync_r(default_fs, addr);
+}
+
+int sfs_munmap(void *addr){
+    return sfs_munmap_r(default_fs, addr);
 }
@@ -1,11 +1,99 @@
 #ifndef _SFS_API_H_
 #define _SFS_API_H_
+#include <sys/uio.h>
+
+// Bytes of a file exposed in place by sfs_fread_view. Each segment points
+// into a pinned cache page, or at zeros for a hole in a sparse file, and
+// stays valid until sfs_release_view.
+typedef struct sfs_view {
+    int count;
+    struct iovec *iov;
+    void **pages;
+} sfs_view;
+
+// Access flags for sfs_mmap
+#define SFS_MAP_READ 1
+#define SFS_MAP_WRITE 2
+
+// Format options for mksfs_opts and sfs_mount. At most one can be used.
+// SFS_LOG never rewrites data in place but appends it to a log.
+#define SFS_COMPRESS 1
+#define SFS_DEDUP 2
+#define SFS_LOG 16
+
+// sfs_mount option to format a new volume rather than open an existing one
+#define SFS_FORMAT 4
+
+// sfs_mount option to give freed blocks back to the host from a background
+// thread, rather than before sfs_remove returns
+#define SFS_DISCARD_ASYNC 8
+
+// sfs_mount option to bypass the host's page cache, so blocks are only
+// cached by the volume itself. Ignored where the host can't do it;
+// sfs_direct tells whether it took effect.
+#define SFS_DIRECT 32
+
+// A mounted volume. Each sfs_*_r call works on the volume it is given, so
+// one process can serve many volumes; a handle must only be used by one
+// thread at a time. The calls without _r work on the volume mksfs opened.
+typedef struct sfs sfs_t;
+
+sfs_t *sfs_mount(const char *path, int opts);
+sfs_t *sfs_mount_striped(const char **paths, int members, int stripe, int opts);
+int sfs_unmount(sfs_t *h);
+void sfs_ls_r(sfs_t *h);
+int sfs_fopen_r(sfs_t *h, char *name);
+int sfs_fclose_r(sfs_t *h, int fileID);
+int sfs_fwrite_r(sfs_t *h, int fileID, char *buf, int length);
+int sfs_fread_r(sfs_t *h, int fileID, char *buf, int length);
+int sfs_fseek_r(sfs_t *h, int fileID, int offset);
+int sfs_fsize_r(sfs_t *h, int fileID);
+int sfs_fallocate_r(sfs_t *h, int fileID, int offset, int length);
+int sfs_ftruncate_r(sfs_t *h, int fileID, int length);
+int sfs_remove_r(sfs_t *h, char *file);
+int sfs_mkdir_r(sfs_t *h, char *path);
+int sfs_lsdir_r(sfs_t *h, char *path);
+int sfs_clone_r(sfs_t *h, char *src, char *dst);
+int sfs_snapshot_r(sfs_t *h, char *path);
+int sfs_defrag_r(sfs_t *h, int max_blocks);
+int sfs_fsck_r(sfs_t *h, int repair);
+int sfs_free_blocks_r(sfs_t *h);
+int sfs_direct_r(sfs_t *h);
+int sfs_warm_hits_r(sfs_t *h);
+int sfs_freadv_r(sfs_t *h, int fileID, const struct iovec *iov, int iovcnt, int offset);
+int sfs_fwritev_r(sfs_t *h, int fileID, const struct iovec *iov, int iovcnt, int offset);
+int sfs_fread_view_r(sfs_t *h, int fileID, int offset, int length, sfs_view *view);
+void sfs_release_view_r(sfs_t *h, sfs_view *view);
+void *sfs_mmap_r(sfs_t *h, int fileID, int offset, int length, int flags);
+int sfs_msync_r(sfs_t *h, void *addr);
+int sfs_munmap_r(sfs_t *h, void *addr);
+
 int mksfs(int fresh);
+int mksfs_opts(int fresh, int flags);
 void sfs_ls(void);
 int sfs_fopen(char *name);
 int sfs_fclose(int fileID);
 int sfs_fwrite(int fileID, char *buf, int length);
 int sfs_fread(int fileID, char *buf, int length);
 int sfs_fseek(int fileID, int offset);
+int sfs_fsize(int fileID);
+int sfs_fallocate(int fileID, int offset, int length);
+int sfs_ftruncate(int fileID, int length);
 int sfs_remove(char *file);
+int sfs_mkdir(char *path);
+int sfs_lsdir(char *path);
+int sfs_clone(char *src, char *dst);
+int sfs_snapshot(char *path);
+int sfs_defrag(int max_blocks);
+int sfs_fsck(int repair);
+int sfs_free_blocks(void);
+int sfs_direct(void);
+int sfs_warm_hits(void);
+int sfs_freadv(int fileID, const struct iovec *iov, int iovcnt, int offset);
+int sfs_fwritev(int fileID, const struct iovec *iov, int iovcnt, int offset);
+int sfs_fread_view(int fileID, int offset, int length, sfs_view *view);
+void sfs_release_view(sfs_view *view);
+void *sfs_mmap(int fileID, int offset, int length, int flags);
+int sfs_msync(void *addr);
+int sfs_munmap(void *addr);
 #endif
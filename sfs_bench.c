@@ -0,0 +1,85 @@
+/* Throughput benchmark: sequential whole-file writes and reads through
+ * the sfs API, with the disk emulator's block checksums off and on, and
+ * with the host's page cache bypassed.
+ *
+ *   ./sfs_bench [passes]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+#define FILE_SIZE (2000 * 1024)
+#define CHUNK 8192
+
+/* Options each pass mounts the volume with */
+static int opts;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* MB/s for writing then reading back the whole file, passes times over */
+static void run(int passes, double *write_mbs, double *read_mbs)
+{
+    static char buf[CHUNK];
+    double t, wt = 0, rt = 0;
+    int p, done, fd;
+
+    for (p = 0; p < passes; p++) {
+        memset(buf, 'a' + p % 26, sizeof(buf));
+        mksfs_opts(1, opts);
+        fd = sfs_fopen("BENCH");
+        t = now();
+        for (done = 0; done < FILE_SIZE; done += CHUNK)
+            sfs_fwrite(fd, buf, CHUNK);
+        wt += now() - t;
+        sfs_fclose(fd);
+
+        /* Remount so the reads come from the disk, not the cache */
+        mksfs_opts(0, opts);
+        fd = sfs_fopen("BENCH");
+        t = now();
+        for (done = 0; done < FILE_SIZE; done += CHUNK) {
+            if (sfs_fread(fd, buf, CHUNK) != CHUNK) {
+                fprintf(stderr, "short read at %d\n", done);
+                exit(1);
+            }
+        }
+        rt += now() - t;
+        sfs_fclose(fd);
+    }
+
+    *write_mbs = passes * (FILE_SIZE / 1048576.0) / wt;
+    *read_mbs = passes * (FILE_SIZE / 1048576.0) / rt;
+}
+
+int main(int argc, char **argv)
+{
+    int passes = argc > 1 ? atoi(argv[1]) : 20;
+    double w0, r0, w1, r1, w2, r2;
+
+    /* Warm up the host's page cache for the image */
+    run(1, &w0, &r0);
+
+    disk_checksums(0);
+    run(passes, &w0, &r0);
+    disk_checksums(1);
+    run(passes, &w1, &r1);
+    opts = SFS_DIRECT;
+    run(passes, &w2, &r2);
+
+    printf("%-12s %10s %10s\n", "", "write MB/s", "read MB/s");
+    printf("%-12s %10.1f %10.1f\n", "no checksum", w0, r0);
+    printf("%-12s %10.1f %10.1f\n", "checksum", w1, r1);
+    printf("%-12s %10.1f %10.1f\n", sfs_direct() ? "direct" : "direct (off)", w2, r2);
+    printf("%-12s %9.1f%% %9.1f%%\n", "overhead",
+           100 * (w0 / w1 - 1), 100 * (r0 / r1 - 1));
+    return 0;
+}
@@ -0,0 +1,318 @@
+/* Client side of sfsd: the file calls of sfs_api.h, served by a daemon
+ * that owns the volume instead of by this process. Link with
+ * libsfsclient.a in place of libsfs.a.
+ *
+ * mksfs connects to the daemon's socket, $SFSD_SOCKET or SFSD_SOCKET by
+ * default; with fresh set it also asks the daemon to format the volume,
+ * which it only does while no client has a file open. sfs_fseek and
+ * sfs_fclose are checked here and not waited for: they go out with the
+ * next request that needs an answer.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "sfs_api.h"
+#include "sfsd.h"
+
+/* Pipelined requests allowed to pile up before they are sent anyway */
+#define MAX_PENDING 64
+
+/* Largest write sent as one request */
+#define MAX_WRITE (1 << 20)
+
+static int sock = -1;
+static sfsd_ring *ring;
+
+/* Requests not sent yet, and how many of those already sent have
+ * replies still to be read */
+static char *out;
+static int out_len, out_cap;
+static int pending;
+
+/* File IDs this client has open, so pipelined calls can be checked
+ * without asking the daemon */
+static char *is_open;
+static int nopen;
+
+static int recv_all(void *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+        n = read(sock, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (char *) buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_all(const char *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+        n = write(sock, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int queue(int op, int fd, int arg, const void *payload, int len)
+{
+    sfsd_req q = {op, fd, arg, len};
+
+    if (out_len + (int) sizeof(q) + len > out_cap) {
+        int cap = out_cap ? out_cap : 4096;
+        char *more;
+
+        while (cap < out_len + (int) sizeof(q) + len)
+            cap *= 2;
+        more = realloc(out, cap);
+        if (more == NULL)
+            return -1;
+        out = more;
+        out_cap = cap;
+    }
+    memcpy(out + out_len, &q, sizeof(q));
+    if (len > 0)
+        memcpy(out + out_len + sizeof(q), payload, len);
+    out_len += sizeof(q) + len;
+    return 0;
+}
+
+/* Send everything queued and read the replies to the pipelined requests.
+ * Those were checked before they were queued, so their replies only
+ * confirm them. */
+static int flush(void)
+{
+    sfsd_resp r;
+
+    if (send_all(out, out_len) == -1)
+        return -1;
+    out_len = 0;
+    for (; pending > 0; pending--) {
+        if (recv_all(&r, sizeof(r)) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+/* Send a request along with everything queued before it, and wait for
+ * its reply */
+static int call(int op, int fd, int arg, const void *payload, int len, sfsd_resp *r)
+{
+    if (sock == -1 || queue(op, fd, arg, payload, len) == -1 || flush() == -1
+            || recv_all(r, sizeof(*r)) == -1) {
+        r->ret = -1;
+        r->len = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Queue a request whose reply nobody waits for */
+static int pipeline(int op, int fd, int arg)
+{
+    if (queue(op, fd, arg, NULL, 0) == -1)
+        return -1;
+    pending++;
+    if (pending >= MAX_PENDING)
+        return flush();
+    return 0;
+}
+
+static void disconnect(void)
+{
+    if (sock == -1)
+        return;
+    flush();
+    munmap(ring, sizeof(sfsd_ring) + SFSD_RING);
+    close(sock);
+    sock = -1;
+    out_len = pending = 0;
+    memset(is_open, 0, nopen);
+}
+
+/* Connect and map the ring the daemon sends along with its greeting */
+static int connect_daemon(void)
+{
+    char *path = getenv("SFSD_SOCKET");
+    struct sockaddr_un addr = {0};
+    sfsd_resp hello;
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&hello, sizeof(hello)};
+    struct msghdr msg = {0};
+    struct cmsghdr *cm;
+    int mem = -1;
+
+    if (path == NULL)
+        path = SFSD_SOCKET;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(sock);
+        sock = -1;
+        return -1;
+    }
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    if (recvmsg(sock, &msg, MSG_WAITALL) == sizeof(hello) && hello.ret == SFSD_RING
+            && (cm = CMSG_FIRSTHDR(&msg)) != NULL && cm->cmsg_type == SCM_RIGHTS)
+        memcpy(&mem, CMSG_DATA(cm), sizeof(int));
+    if (mem >= 0) {
+        ring = mmap(NULL, sizeof(sfsd_ring) + SFSD_RING, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, mem, 0);
+        close(mem);
+    }
+    if (mem < 0 || ring == MAP_FAILED) {
+        fprintf(stderr, "Bad greeting from sfsd at %s\n", path);
+        close(sock);
+        sock = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int mksfs_opts(int fresh, int flags)
+{
+    sfsd_resp r;
+
+    disconnect();
+    if (connect_daemon() == -1) {
+        fprintf(stderr, "Cannot reach sfsd");
+        return -1;
+    }
+    if (fresh && call(SFSD_FORMAT, -1, flags, NULL, 0, &r) == 0)
+        return r.ret;
+    return sock == -1 ? -1 : 0;
+}
+
+int mksfs(int fresh)
+{
+    return mksfs_opts(fresh, 0);
+}
+
+/* The daemon sends back the listing; print it here as sfs_ls would */
+void sfs_ls(void)
+{
+    char buf[4096];
+    sfsd_resp r;
+    int n;
+
+    if (call(SFSD_LS, -1, 0, NULL, 0, &r) == -1)
+        return;
+    while (r.len > 0) {
+        n = r.len < (int) sizeof(buf) ? r.len : (int) sizeof(buf);
+        if (recv_all(buf, n) == -1)
+            return;
+        fwrite(buf, 1, n, stdout);
+        r.len -= n;
+    }
+}
+
+int sfs_fopen(char *name)
+{
+    int len = strlen(name);
+    sfsd_resp r;
+
+    if (len >= SFSD_NAME || call(SFSD_OPEN, -1, 0, name, len, &r) == -1 || r.ret < 0)
+        return -1;
+
+    if (r.ret >= nopen) {
+        char *more = realloc(is_open, r.ret + 1);
+        if (more == NULL)
+            return -1;
+        memset(more + nopen, 0, r.ret + 1 - nopen);
+        is_open = more;
+        nopen = r.ret + 1;
+    }
+    is_open[r.ret] = 1;
+    return r.ret;
+}
+
+int sfs_fclose(int fileID)
+{
+    if (sock == -1 || fileID < 0 || fileID >= nopen || !is_open[fileID])
+        return -1;
+
+    is_open[fileID] = 0;
+    return pipeline(SFSD_CLOSE, fileID, 0);
+}
+
+int sfs_fseek(int fileID, int offset)
+{
+    if (sock == -1 || fileID < 0 || fileID >= nopen || !is_open[fileID])
+        return -1;
+
+    return pipeline(SFSD_SEEK, fileID, offset);
+}
+
+int sfs_fwrite(int fileID, char *buf, int length)
+{
+    sfsd_resp r;
+    int done = 0, n;
+
+    if (buf == NULL || length < 0)
+        return -1;
+
+    do {
+        n = length - done < MAX_WRITE ? length - done : MAX_WRITE;
+        if (call(SFSD_WRITE, fileID, 0, buf + done, n, &r) == -1 || r.ret <= 0)
+            break;
+        done += r.ret;
+    } while (done < length && r.ret == n);
+
+    return done ? done : r.ret;
+}
+
+int sfs_fread(int fileID, char *buf, int length)
+{
+    sfsd_resp r;
+
+    if (buf == NULL || length < 0 || call(SFSD_READ, fileID, length, NULL, 0, &r) == -1)
+        return -1;
+
+    if (r.len > 0)
+        return recv_all(buf, r.len) == -1 ? -1 : r.ret;
+    if (r.ret > 0) {
+        /* Read straight into the ring by the daemon; give the space back */
+        memcpy(buf, ring->data + r.ring % SFSD_RING, r.ret);
+        __atomic_store_n(&ring->tail, r.ring + r.ret, __ATOMIC_RELEASE);
+    }
+    return r.ret;
+}
+
+int sfs_remove(char *file)
+{
+    int len = strlen(file);
+    sfsd_resp r;
+
+    if (len >= SFSD_NAME || call(SFSD_REMOVE, -1, 0, file, len, &r) == -1)
+        return -1;
+    return r.ret;
+}
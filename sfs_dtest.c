@@ -0,0 +1,246 @@
+/* Tests sfsd and the client library: starts a daemon on a fresh image,
+ * then works on it from this process and a second one.
+ *
+ *   ./sfs_dtest
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "sfs_api.h"
+#include "sfsd.h"
+
+#define SOCKET "dtest.sock"
+#define IMAGE "dtest.sfs"
+#define BIG (300 * 1024)
+
+static char data[BIG], back[BIG];
+
+/* Connect to the daemon without the client library, and open BIG.
+ * Returns the socket, with *id set to the file's ID, or -1. */
+static int raw_open(int *id)
+{
+    struct sockaddr_un addr = {0};
+    sfsd_req open = {SFSD_OPEN, -1, 0, 3};
+    sfsd_resp r;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, SOCKET);
+    if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || read(sock, &r, sizeof(r)) != sizeof(r)
+            || write(sock, &open, sizeof(open)) != sizeof(open) || write(sock, "BIG", 3) != 3
+            || read(sock, &r, sizeof(r)) != sizeof(r) || r.ret < 0) {
+        if (sock >= 0)
+            close(sock);
+        return -1;
+    }
+    *id = r.ret;
+    return sock;
+}
+
+/* Read the whole of BIG back in one call and compare it */
+static int check_big(int fd)
+{
+    memset(back, 0, sizeof(back));
+    sfs_fseek(fd, 0);
+    return sfs_fread(fd, back, sizeof(back)) == sizeof(back)
+        && memcmp(data, back, sizeof(back)) == 0;
+}
+
+int main()
+{
+    int error_count = 0, fd, i, status;
+    pid_t daemon, other;
+
+    for (i = 0; i < BIG; i++)
+        data[i] = i * 31 + i / 1000;
+
+    unlink(SOCKET);
+    daemon = fork();
+    if (daemon == 0) {
+        execl("./sfsd", "sfsd", "-f", "-s", SOCKET, IMAGE, (char *) NULL);
+        perror("./sfsd");
+        exit(1);
+    }
+    setenv("SFSD_SOCKET", SOCKET, 1);
+
+    /* Wait for the daemon to start listening */
+    for (i = 0; i < 200 && access(SOCKET, F_OK) != 0; i++)
+        usleep(10000);
+    if (mksfs(1) != 0) {
+        fprintf(stderr, "ERROR: could not reach sfsd\n");
+        kill(daemon, SIGTERM);
+        return 1;
+    }
+
+    printf("Tests reads and writes through sfsd\n");
+
+    fd = sfs_fopen("BIG");
+    if (fd < 0 || sfs_fwrite(fd, data, sizeof(data)) != sizeof(data)) {
+        fprintf(stderr, "ERROR: writing through sfsd failed\n");
+        error_count++;
+    }
+    if (!check_big(fd)) {
+        fprintf(stderr, "ERROR: a large read through sfsd should match what was written\n");
+        error_count++;
+    }
+    sfs_fseek(fd, 5000);
+    if (sfs_fread(fd, back, 100) != 100 || memcmp(data + 5000, back, 100) != 0) {
+        fprintf(stderr, "ERROR: a small read through sfsd should match what was written\n");
+        error_count++;
+    }
+    if (sfs_fopen("BIG") != fd) {
+        fprintf(stderr, "ERROR: opening a file twice should give the same ID\n");
+        error_count++;
+    }
+
+    printf("Tests two clients of sfsd\n");
+
+    fflush(stdout);
+    other = fork();
+    if (other == 0) {
+        int errors = 0, big;
+
+        if (mksfs(0) != 0)
+            exit(1);
+        big = sfs_fopen("BIG");
+        if (big < 0 || !check_big(big)) {
+            fprintf(stderr, "ERROR: a second client should see the first one's file\n");
+            errors++;
+        }
+        fd = sfs_fopen("OTHER");
+        if (sfs_fwrite(fd, "from the other client", 22) != 22) {
+            fprintf(stderr, "ERROR: the second client's write failed\n");
+            errors++;
+        }
+        exit(errors);
+    }
+    waitpid(other, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        error_count++;
+
+    fd = sfs_fopen("OTHER");
+    if (fd < 0 || sfs_fread(fd, back, 100) != 22 || strcmp(back, "from the other client") != 0) {
+        fprintf(stderr, "ERROR: a file written by another client should read back\n");
+        error_count++;
+    }
+    sfs_fclose(fd);
+
+    printf("Tests pipelined calls through sfsd\n");
+
+    fd = sfs_fopen("BIG");
+    for (i = 0; i < 200; i++)
+        sfs_fseek(fd, i);
+    if (sfs_fread(fd, back, 10) != 10 || memcmp(data + 199, back, 10) != 0) {
+        fprintf(stderr, "ERROR: pipelined seeks should all be applied in order\n");
+        error_count++;
+    }
+    if (sfs_fclose(fd) != 0 || sfs_fclose(fd) != -1 || sfs_fread(fd, back, 10) != -1) {
+        fprintf(stderr, "ERROR: a closed file should not be usable\n");
+        error_count++;
+    }
+    if (sfs_remove("OTHER") != 0 || (fd = sfs_fopen("OTHER")) < 0 || sfs_fread(fd, back, 10) != 0) {
+        fprintf(stderr, "ERROR: a removed file should come back empty\n");
+        error_count++;
+    }
+
+    sfs_fclose(fd);
+
+    printf("Tests listing and formatting through sfsd\n");
+
+    {
+        FILE *list = tmpfile();
+        char line[128];
+        int out, found = 0;
+
+        fflush(stdout);
+        out = dup(STDOUT_FILENO);
+        if (list != NULL && out >= 0) {
+            dup2(fileno(list), STDOUT_FILENO);
+            sfs_ls();
+            fflush(stdout);
+            dup2(out, STDOUT_FILENO);
+            rewind(list);
+            while (fgets(line, sizeof(line), list))
+                found |= strstr(line, "BIG") != NULL;
+        }
+        if (!found) {
+            fprintf(stderr, "ERROR: sfs_ls should list the daemon's files\n");
+            error_count++;
+        }
+        if (out >= 0)
+            close(out);
+        if (list != NULL)
+            fclose(list);
+    }
+
+    /* Options that can't go together make the format fail */
+    if (mksfs_opts(1, SFS_COMPRESS | SFS_DEDUP) != -1) {
+        fprintf(stderr, "ERROR: a format with conflicting options should fail\n");
+        error_count++;
+    }
+    fd = sfs_fopen("BIG");
+    if (fd < 0 || !check_big(fd)) {
+        fprintf(stderr, "ERROR: a failed format should leave the old volume served\n");
+        error_count++;
+    }
+    sfs_fclose(fd);
+
+    printf("Tests a client that doesn't take its replies\n");
+
+    {
+        sfsd_req reqs[2 * 1000];
+        int sock, id;
+
+        /* Megabytes of replies, far more than the socket holds */
+        sock = raw_open(&id);
+        for (i = 0; i < 1000; i++) {
+            reqs[2 * i] = (sfsd_req) {SFSD_SEEK, id, 0, 0};
+            reqs[2 * i + 1] = (sfsd_req) {SFSD_READ, id, SFSD_RING_MIN - 1, 0};
+        }
+        if (sock < 0 || write(sock, reqs, sizeof(reqs)) != sizeof(reqs)) {
+            fprintf(stderr, "ERROR: could not talk to sfsd without the client library\n");
+            error_count++;
+        }
+
+        /* Everyone else is still served while it doesn't read them */
+        fflush(stdout);
+        other = fork();
+        if (other == 0) {
+            int big;
+
+            if (mksfs(0) != 0)
+                exit(1);
+            big = sfs_fopen("BIG");
+            exit(big < 0 || !check_big(big));
+        }
+        for (i = 0; i < 500 && waitpid(other, &status, WNOHANG) == 0; i++)
+            usleep(10000);
+        if (i == 500) {
+            kill(other, SIGKILL);
+            waitpid(other, &status, 0);
+        }
+        if (i == 500 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "ERROR: a client that doesn't take its replies should hold up nobody else\n");
+            error_count++;
+        }
+        if (sock >= 0)
+            close(sock);
+    }
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "ERROR: sfsd should exit cleanly on SIGTERM\n");
+        error_count++;
+    }
+
+    fprintf(stderr, "Test program exiting with %d errors\n", error_count);
+    return error_count;
+}
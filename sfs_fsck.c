@@ -0,0 +1,55 @@
+/* Check the file system image, optionally repairing it.
+ *
+ *   ./sfs_fsck [-r] [image]
+ *
+ * The image defaults to my.sfs, the one mksfs opens. Exits 0 if the
+ * image is consistent, 1 if problems were found and repaired, and 4 if
+ * problems are left.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+int main(int argc, char **argv)
+{
+    int repair = argc > 1 && strcmp(argv[1], "-r") == 0;
+    const char *image = argc > 1 + repair ? argv[1 + repair] : "my.sfs";
+    int found, left, status;
+    sfs_t *vol;
+
+    if (argc > 2 + repair || image[0] == '-') {
+        fprintf(stderr, "usage: %s [-r] [image]\n", argv[0]);
+        return 8;
+    }
+
+    vol = sfs_mount(image, 0);
+    if (vol == NULL) {
+        fprintf(stderr, "Cannot open the file system\n");
+        return 8;
+    }
+
+    found = sfs_fsck_r(vol, repair);
+    if (found < 0) {
+        status = 8;
+    } else if (found == 0) {
+        printf("clean\n");
+        status = 0;
+    } else if (!repair) {
+        printf("%d problems\n", found);
+        status = 4;
+    } else {
+        /* Anything the repair couldn't fix shows up again */
+        left = sfs_fsck_r(vol, 0);
+        if (left < 0) {
+            status = 8;
+        } else {
+            printf("%d problems, %d left after repair\n", found, left);
+            status = left ? 4 : 1;
+        }
+    }
+
+    /* Writes the repairs back */
+    sfs_unmount(vol);
+    return status;
+}
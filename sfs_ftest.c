@@ -1,8 +1,17 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "sfs_api.h"
+#include "disk_emu.h"
 
 /* The maximum file name length. We assume that filenames can contain
  * upper-case letters and periods ('.') characters. Feel free to
@@ -55,6 +64,121 @@ char *rand_name()
     return (strdup(fname));
 }
 
+/* Where mksfs lays out a volume, for the tests that damage one behind
+ * its back.
+ */
+#define IMG_BLOCK 2048
+#define IMG_FREE_LIST 1       /* one bit per data block */
+#define IMG_ROOT 2            /* root directory entries */
+#define IMG_FAT 130           /* 4 byte FAT entries */
+#define IMG_DATA 154          /* the first data block */
+#define IMG_ENTRY 128         /* bytes in a directory entry */
+#define IMG_END 0             /* a FAT link ending the chain */
+
+/* img_read(), img_write() - read or overwrite len bytes of the image at
+ * path, at offset. Overwriting also marks the block checksums stale, as
+ * a crash would, so the damage reads back rather than failing.
+ */
+static void img_read(const char *path, long offset, void *bytes, int len)
+{
+    FILE *img = fopen(path, "rb");
+
+    memset(bytes, 0, len);
+    if (img != NULL) {
+        fseek(img, offset, SEEK_SET);
+        if (fread(bytes, 1, len, img) != len)
+            memset(bytes, 0, len);
+        fclose(img);
+    }
+}
+
+static void img_write(const char *path, long offset, const void *bytes, int len)
+{
+    FILE *img = fopen(path, "r+b");
+    unsigned int stale = 0;
+
+    if (img != NULL) {
+        fseek(img, offset, SEEK_SET);
+        fwrite(bytes, 1, len, img);
+        fseek(img, -(long) sizeof(stale), SEEK_END);
+        fwrite(&stale, sizeof(stale), 1, img);
+        fclose(img);
+    }
+}
+
+/* img_lookup() - find name in the root directory of the image at path,
+ * returning its slot and setting *first to the FAT entry its chain
+ * starts at, or -1 if it isn't there.
+ */
+static int img_lookup(const char *path, const char *name, int *first)
+{
+    unsigned char dir[IMG_BLOCK];
+    unsigned short indx;
+    int slot;
+
+    img_read(path, IMG_ROOT * IMG_BLOCK, dir, sizeof(dir));
+    for (slot = 0; slot < IMG_BLOCK / IMG_ENTRY; slot++) {
+        if (strcmp((char *) dir + slot * IMG_ENTRY, name) == 0) {
+            memcpy(&indx, dir + slot * IMG_ENTRY + 14, sizeof(indx));
+            *first = indx - 1;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+/* img_fat() - the data block and next link of FAT entry k, as stored:
+ * both one more than the index, with 0 for none.
+ */
+static void img_fat(const char *path, int k, unsigned short raw[2])
+{
+    img_read(path, IMG_FAT * IMG_BLOCK + 4L * k, raw, 2 * sizeof(raw[0]));
+}
+
+/* For the disk request queue tests: a read made from a thread of its
+ * own, with its own deadline unless that is -1, and the transfers the
+ * disk made.
+ */
+typedef struct queued_read {
+    int block, deadline;
+    pthread_t thread;
+} queued_read;
+
+static disk_t *queue_disk;
+static int queue_log[16][2], queue_logged;
+
+static void *queue_read(void *arg)
+{
+    queued_read *r = arg;
+    char block[512];
+
+    if (r->deadline >= 0)
+        disk_set_thread_deadline(r->deadline);
+    disk_read(queue_disk, r->block, 1, block);
+    return NULL;
+}
+
+/* queue_trace() - log a transfer. The first one holds the disk until
+ * the reads in arg, up to one with block -1, are all queued behind it,
+ * so the order they are served in is up to the queue alone.
+ */
+static void queue_trace(void *arg, int start_address, int nblocks, int write)
+{
+    queued_read *reads = arg;
+    int i;
+
+    if (queue_logged < 16) {
+        queue_log[queue_logged][0] = start_address;
+        queue_log[queue_logged][1] = nblocks;
+    }
+    if (queue_logged++ > 0)
+        return;
+    for (i = 0; reads[i].block >= 0; i++)
+        pthread_create(&reads[i].thread, NULL, queue_read, &reads[i]);
+    while (disk_queued(queue_disk) < i)
+        usleep(1000);
+}
+
 /* The main testing program
 */
     int
@@ -325,6 +449,1290 @@ main(int argc, char **argv)
         error_count++;
     }
 
+    //-------- The following part tests sfs_freadv and sfs_fwritev
+
+    printf("Tests sfs_freadv and sfs_fwritev\n");
+
+    struct iovec iov[3];
+    char head[4], body[2048 + 6], tail[6];
+
+    memcpy(head, "HEAD", 4);
+    memset(body, 'b', sizeof(body));
+    memcpy(tail, "TAIL..", 6);
+    iov[0] = (struct iovec) {.iov_base = head, .iov_len = 4};
+    iov[1] = (struct iovec) {.iov_base = body, .iov_len = sizeof(body)};
+    iov[2] = (struct iovec) {.iov_base = tail, .iov_len = 6};
+
+    // Part the read and write pointers, to 35 and 23
+    sfs_fseek(f_id, 20);
+    sfs_fwrite(f_id, "012", 3);
+    sfs_fread(f_id, buffer, 15);
+
+    // Gather across a block boundary, starting past the end of the file
+    if (sfs_fwritev(f_id, iov, 3, 2040) != 4 + sizeof(body) + 6) {
+        fprintf(stderr, "ERROR: sfs_fwritev should write %d bytes\n",
+                (int)(4 + sizeof(body) + 6));
+        error_count++;
+    }
+
+    memset(head, 0, 4);
+    memset(body, 0, sizeof(body));
+    memset(tail, 0, 6);
+    if (sfs_freadv(f_id, iov, 3, 2040) != 4 + sizeof(body) + 6
+            || strncmp(head, "HEAD", 4) != 0 || body[0] != 'b'
+            || body[sizeof(body) - 1] != 'b' || strncmp(tail, "TAIL..", 6) != 0) {
+        fprintf(stderr, "ERROR: sfs_freadv should read back what was written\n");
+        error_count++;
+    }
+
+    // The file pointers are left where they were
+    sfs_fread(f_id, buffer, 2);
+    sfs_fwrite(f_id, "w", 1);
+    if (strncmp(buffer, "56", 2) != 0) {
+        fprintf(stderr, "ERROR: sfs_freadv or sfs_fwritev moved the read pointer\n");
+        error_count++;
+    }
+    sfs_fseek(f_id, 22);
+    sfs_fread(f_id, buffer, 3);
+    if (strncmp(buffer, "2w4", 3) != 0) {
+        fprintf(stderr, "ERROR: sfs_freadv or sfs_fwritev moved the write pointer\n");
+        error_count++;
+    }
+
+    // The gap between the old end of file and the write reads as zeros
+    sfs_fseek(f_id, 100);
+    sfs_fread(f_id, buffer, 10);
+    for (i = 0; i < 10; i++) {
+        if (buffer[i] != 0) {
+            fprintf(stderr, "ERROR: gap should read as zeros\n");
+            error_count++;
+            break;
+        }
+    }
+
+    //-------- The following part tests sfs_fread_view
+
+    printf("Tests sfs_fread_view\n");
+
+    sfs_view view;
+    tmp = sfs_fread_view(f_id, 2040, 4 + 2048 + 6, &view);
+    if (tmp != 4 + 2048 + 6 || view.count != 3) {
+        fprintf(stderr, "ERROR: view should span 3 blocks\n");
+        error_count++;
+    }
+    else if (strncmp(view.iov[0].iov_base, "HEAD", 4) != 0
+            || view.iov[1].iov_len != 2048
+            || ((char *)view.iov[1].iov_base)[0] != 'b') {
+        fprintf(stderr, "ERROR: view should show the file contents\n");
+        error_count++;
+    }
+    sfs_release_view(&view);
+
+    // Small files are viewed inside their directory entry
+    char *small_name = rand_name();
+    int small_id = sfs_fopen(small_name);
+    sfs_fwrite(small_id, test_str, 20);
+    if (sfs_fread_view(small_id, 5, 100, &view) != 15 || view.count != 1
+            || strncmp(view.iov[0].iov_base, test_str + 5, 15) != 0) {
+        fprintf(stderr, "ERROR: view of a small file\n");
+        error_count++;
+    }
+    sfs_release_view(&view);
+
+    // Growing it past the inline limit keeps what was there
+    memset(fixedbuf, 'x', 200);
+    sfs_fwrite(small_id, fixedbuf, 200);
+    sfs_fseek(small_id, 0);
+    if (sfs_fread(small_id, fixedbuf, 220) != 220
+            || strncmp(fixedbuf, test_str, 20) != 0 || fixedbuf[219] != 'x') {
+        fprintf(stderr, "ERROR: small file lost data when it grew\n");
+        error_count++;
+    }
+    sfs_fclose(small_id);
+    sfs_remove(small_name);
+    free(small_name);
+
+    //-------- The following part tests sfs_mmap
+
+    printf("Tests sfs_mmap\n");
+
+    char *map = sfs_mmap(f_id, 0, 4096, SFS_MAP_READ | SFS_MAP_WRITE);
+    if (map == NULL || strncmp(map, "0123456789", 10) != 0
+            || strncmp(map + 2040, "HEAD", 4) != 0) {
+        fprintf(stderr, "ERROR: mapping should show the file contents\n");
+        error_count++;
+    }
+    else {
+        memcpy(map + 2046, "MAPPED", 6);
+        sfs_munmap(map);
+        sfs_fseek(f_id, 2046);
+        sfs_fread(f_id, buffer, 6);
+        if (strncmp(buffer, "MAPPED", 6) != 0) {
+            fprintf(stderr, "ERROR: sfs_munmap should write the mapping back\n");
+            error_count++;
+        }
+    }
+
+    //-------- The following part tests sfs_mkdir
+
+    printf("Tests sfs_mkdir\n");
+
+    if (sfs_mkdir("DIR") != 0 || sfs_mkdir("DIR/SUB") != 0) {
+        fprintf(stderr, "ERROR: creating directories\n");
+        error_count++;
+    }
+    if (sfs_mkdir("DIR") == 0 || sfs_mkdir("NODIR/SUB") == 0) {
+        fprintf(stderr, "ERROR: mkdir over an existing name or missing parent\n");
+        error_count++;
+    }
+
+    // Enough entries to split the directory's B-tree a few times
+    for (i = 0; i < 300; i++) {
+        char path[32];
+        sprintf(path, "DIR/SUB/F%03d", (i * 7) % 300);
+        tmp = sfs_fopen(path);
+        if (tmp < 0 || sfs_fwrite(tmp, path, strlen(path)) != strlen(path)) {
+            fprintf(stderr, "ERROR: creating %s\n", path);
+            error_count++;
+            break;
+        }
+        sfs_fclose(tmp);
+    }
+
+    for (i = 0; i < 300; i += 2) {
+        char path[32];
+        sprintf(path, "DIR/SUB/F%03d", i);
+        if (sfs_remove(path) != 0) {
+            fprintf(stderr, "ERROR: removing %s\n", path);
+            error_count++;
+        }
+    }
+
+    for (i = 0; i < 300; i++) {
+        char path[32];
+        sprintf(path, "DIR/SUB/F%03d", i);
+        tmp = sfs_fopen(path);
+        memset(fixedbuf, 0, sizeof(fixedbuf));
+        if (tmp < 0 || (sfs_fread(tmp, fixedbuf, sizeof(fixedbuf)) > 0) != (i % 2)
+                || (i % 2 && strcmp(fixedbuf, path) != 0)) {
+            fprintf(stderr, "ERROR: wrong contents in %s\n", path);
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        sfs_remove(path);
+    }
+
+    // More entries than a tree two levels deep holds, so inserts have to
+    // split nodes below the root's children
+    if (sfs_mkdir("DIR/DEEP") != 0) {
+        fprintf(stderr, "ERROR: creating DIR/DEEP\n");
+        error_count++;
+    }
+    for (i = 0; i < 1000; i++) {
+        char path[32];
+        sprintf(path, "DIR/DEEP/F%03d", (i * 7) % 1000);
+        tmp = sfs_fopen(path);
+        if (tmp < 0 || sfs_fwrite(tmp, path, strlen(path) + 1) != strlen(path) + 1) {
+            fprintf(stderr, "ERROR: creating %s\n", path);
+            error_count++;
+            break;
+        }
+        sfs_fclose(tmp);
+    }
+    for (i = 0; i < 1000; i++) {
+        char path[32];
+        sprintf(path, "DIR/DEEP/F%03d", i);
+        tmp = sfs_fopen(path);
+        memset(fixedbuf, 0, sizeof(fixedbuf));
+        if (tmp < 0 || sfs_fread(tmp, fixedbuf, sizeof(fixedbuf)) != strlen(path) + 1
+                || strcmp(fixedbuf, path) != 0) {
+            fprintf(stderr, "ERROR: %s lost in a deep directory\n", path);
+            error_count++;
+            break;
+        }
+        sfs_fclose(tmp);
+        sfs_remove(path);
+    }
+    sfs_remove("DIR/DEEP");
+
+    // A split that runs out of blocks half way leaves the tree sound:
+    // the root is full, and only one block is left for the two new nodes
+    sfs_mkdir("DIR/FULL");
+    for (i = 0; i < 16; i++) {
+        char path[32];
+        sprintf(path, "DIR/FULL/F%02d", i);
+        if (i == 15) {
+            tmp = sfs_fopen("FILLER");
+            memset(fixedbuf, 'f', sizeof(fixedbuf));
+            while (sfs_free_blocks() > 1
+                    && sfs_fwrite(tmp, fixedbuf, sizeof(fixedbuf)) == sizeof(fixedbuf))
+                ;
+            sfs_fclose(tmp);
+        }
+        tmp = sfs_fopen(path);
+        if ((tmp < 0) != (i == 15)) {
+            fprintf(stderr, "ERROR: creating %s with %d blocks free\n", path, sfs_free_blocks());
+            error_count++;
+        }
+        sfs_fclose(tmp);
+    }
+    sfs_remove("FILLER");
+    for (i = 15; i < 40; i++) {
+        char path[32];
+        sprintf(path, "DIR/FULL/F%02d", i);
+        sfs_fclose(sfs_fopen(path));
+    }
+    if (sfs_fsck(0) != 0) {
+        fprintf(stderr, "ERROR: a directory split that ran out of space was left damaged\n");
+        error_count++;
+    }
+    for (i = 0; i < 40; i++) {
+        char path[32];
+        sprintf(path, "DIR/FULL/F%02d", i);
+        if (sfs_remove(path) != 0) {
+            fprintf(stderr, "ERROR: %s lost after a split ran out of space\n", path);
+            error_count++;
+            break;
+        }
+    }
+    sfs_remove("DIR/FULL");
+
+    if (sfs_remove("DIR") == 0) {
+        fprintf(stderr, "ERROR: removed a directory that isn't empty\n");
+        error_count++;
+    }
+    if (sfs_remove("DIR/SUB") != 0 || sfs_remove("DIR") != 0) {
+        fprintf(stderr, "ERROR: removing empty directories\n");
+        error_count++;
+    }
+
+    //-------- The following part tests compressed volumes
+
+    printf("Tests mksfs_opts(SFS_COMPRESS)\n");
+
+    if (mksfs_opts(1, SFS_COMPRESS) != 0) {
+        fprintf(stderr, "ERROR: formatting a compressed volume\n");
+        error_count++;
+    }
+    {
+        static char text[6000], back[6000];
+        for (i = 0; i < sizeof(text); i++)
+            text[i] = "compressible "[i % 13];
+        text[3000] = '!';
+
+        // Rewrite a block so its fragments shrink and grow in place
+        tmp = sfs_fopen("Z");
+        if (sfs_fwrite(tmp, text, sizeof(text)) != sizeof(text)
+                || sfs_fwritev(tmp, &(struct iovec) {.iov_base = back, .iov_len = 700}, 1, 2100) != 700
+                || sfs_fwritev(tmp, &(struct iovec) {.iov_base = text + 2100, .iov_len = 700}, 1, 2100) != 700) {
+            fprintf(stderr, "ERROR: writing a compressed file\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        mksfs_opts(0, 0);
+
+        tmp = sfs_fopen("Z");
+        if (sfs_fread(tmp, back, sizeof(back)) != sizeof(back)
+                || memcmp(text, back, sizeof(text)) != 0) {
+            fprintf(stderr, "ERROR: compressed file should read back after remount\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+    }
+
+    //-------- The following part tests block checksums
+
+    printf("Tests block checksums\n");
+
+    mksfs(1);
+    {
+        static char block[4096];
+        FILE *disk;
+        long pos = -1;
+
+        for (i = 0; i < sizeof(block); i++)
+            block[i] = "CHECKSUMMED"[i % 11];
+        tmp = sfs_fopen("SUM");
+        sfs_fwrite(tmp, block, sizeof(block));
+        sfs_fclose(tmp);
+        mksfs(0);   /* writes the checksums back */
+
+        // Flip a byte of the second block behind the file system's back
+        disk = fopen("my.sfs", "r+b");
+        while (disk != NULL && fread(block, 1, 11, disk) == 11) {
+            if (memcmp(block, "CHECKSUMMED", 11) == 0) {
+                pos = ftell(disk) - 11;
+                break;
+            }
+            fseek(disk, 2048 - 11, SEEK_CUR);
+        }
+        if (pos >= 0) {
+            fseek(disk, pos + 2048 + 100, SEEK_SET);
+            fputc('X', disk);
+        }
+        if (disk != NULL)
+            fclose(disk);
+        mksfs(0);   /* drops anything read back before the damage */
+
+        tmp = sfs_fopen("SUM");
+        if (pos < 0 || sfs_fread(tmp, block, sizeof(block)) != 2048
+                || sfs_fread(tmp, block, 10) != -1) {
+            fprintf(stderr, "ERROR: a corrupted block should fail to read\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+    }
+
+    //-------- The following part tests deduplicated volumes
+
+    printf("Tests mksfs_opts(SFS_DEDUP)\n");
+
+    if (mksfs_opts(1, SFS_DEDUP) != 0) {
+        fprintf(stderr, "ERROR: formatting a dedup volume\n");
+        error_count++;
+    }
+    {
+        static char text[6144], back[6144];
+        char name[16];
+
+        for (i = 0; i < sizeof(text); i++)
+            text[i] = "template "[i % 9];
+
+        // More blocks than the disk has, as most of them are shared
+        for (i = 0; i < 800; i++) {
+            sprintf(name, "D%d", i);
+            sprintf(text + 4096, "copy %03d", i);
+            tmp = sfs_fopen(name);
+            if (sfs_fwrite(tmp, text, sizeof(text)) != sizeof(text)) {
+                fprintf(stderr, "ERROR: writing duplicate file %d\n", i);
+                error_count++;
+                break;
+            }
+            sfs_fclose(tmp);
+        }
+        mksfs(0);
+
+        // Changing one copy leaves the others alone
+        tmp = sfs_fopen("D0");
+        sfs_fseek(tmp, 0);
+        sfs_fwrite(tmp, "CHANGED", 7);
+        sfs_fclose(tmp);
+        tmp = sfs_fopen("D1");
+        if (sfs_fread(tmp, back, sizeof(back)) != sizeof(back)
+                || memcmp(back, text, 4096) != 0 || strcmp(back + 4096, "copy 001") != 0) {
+            fprintf(stderr, "ERROR: a shared block changed under another file\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        tmp = sfs_fopen("D0");
+        if (sfs_fread(tmp, back, 7) != 7 || memcmp(back, "CHANGED", 7) != 0) {
+            fprintf(stderr, "ERROR: writing to a shared block\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+    }
+
+    //-------- The following part tests sfs_clone and sfs_snapshot
+
+    printf("Tests sfs_clone and sfs_snapshot\n");
+
+    mksfs(1);
+    {
+        static char text[5000], back[5000];
+
+        for (i = 0; i < sizeof(text); i++)
+            text[i] = 'a' + i % 26;
+        tmp = sfs_fopen("ORIG");
+        sfs_fwrite(tmp, text, sizeof(text));
+        sfs_fclose(tmp);
+
+        if (sfs_clone("ORIG", "COPY") != 0 || sfs_clone("ORIG", "COPY") == 0
+                || sfs_snapshot("SNAP") != 0) {
+            fprintf(stderr, "ERROR: cloning files\n");
+            error_count++;
+        }
+
+        // Writing to the original copies the block instead of sharing the change
+        tmp = sfs_fopen("ORIG");
+        sfs_fseek(tmp, 2100);
+        sfs_fwrite(tmp, "CHANGED", 7);
+        sfs_fclose(tmp);
+
+        tmp = sfs_fopen("COPY");
+        if (sfs_fread(tmp, back, sizeof(back)) != sizeof(back)
+                || memcmp(back, text, sizeof(text)) != 0) {
+            fprintf(stderr, "ERROR: clone changed with its original\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        tmp = sfs_fopen("SNAP/COPY");
+        if (tmp < 0 || sfs_fread(tmp, back, sizeof(back)) != sizeof(back)
+                || memcmp(back, text, sizeof(text)) != 0) {
+            fprintf(stderr, "ERROR: snapshot should hold the files as they were\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        tmp = sfs_fopen("ORIG");
+        if (sfs_fread(tmp, back, sizeof(back)) != sizeof(back)
+                || memcmp(back + 2100, "CHANGED", 7) != 0) {
+            fprintf(stderr, "ERROR: writing to a cloned file\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+    }
+
+    //-------- The following part tests sfs_defrag
+
+    printf("Tests sfs_defrag\n");
+
+    mksfs(1);
+    {
+        static char block[2048];
+        int fds[3], moved = 0, calls = 0, n;
+
+        // Interleave three files so each one's blocks are scattered
+        fds[0] = sfs_fopen("FRAG0");
+        fds[1] = sfs_fopen("FRAG1");
+        fds[2] = sfs_fopen("FRAG2");
+        for (i = 0; i < 30; i++) {
+            memset(block, 'a' + i % 3, sizeof(block));
+            sprintf(block, "%d", i / 3);
+            sfs_fwrite(fds[i % 3], block, sizeof(block));
+        }
+        sfs_fclose(fds[1]);
+        sfs_remove("FRAG1");
+
+        while ((n = sfs_defrag(4)) > 0 && calls++ < 100) {
+            if (n > 4) {
+                fprintf(stderr, "ERROR: sfs_defrag moved more than it was allowed\n");
+                error_count++;
+            }
+            moved += n;
+        }
+        if (moved == 0 || sfs_defrag(0) != 0) {
+            fprintf(stderr, "ERROR: sfs_defrag should finish moving the files\n");
+            error_count++;
+        }
+
+        sfs_fseek(fds[2], 0);
+        for (i = 0; i < 10; i++) {
+            static char back[2048];
+            memset(block, 'c', sizeof(block));
+            sprintf(block, "%d", i);
+            if (sfs_fread(fds[2], back, sizeof(back)) != sizeof(back)
+                    || memcmp(block, back, sizeof(back)) != 0) {
+                fprintf(stderr, "ERROR: defragmented file should read back the same\n");
+                error_count++;
+                break;
+            }
+        }
+        sfs_fclose(fds[0]);
+        sfs_fclose(fds[2]);
+
+        // Removing a file the pass is done with, while it is part way
+        // through the next, doesn't make it skip the rest of that one
+        fds[0] = sfs_fopen("MOVE0");
+        fds[1] = sfs_fopen("MOVE1");
+        fds[2] = sfs_fopen("MOVE2");
+        for (i = 0; i < 30; i++)
+            sfs_fwrite(fds[i % 3], block, sizeof(block));
+        for (i = 0; i < 3; i++)
+            sfs_fclose(fds[i]);
+        for (i = 0; i < 3; i++)
+            sfs_defrag(4);
+        sfs_remove("MOVE0");
+        for (calls = 0; sfs_defrag(4) == 4 && calls < 100; calls++)
+            ;
+        if (sfs_defrag(0) != 0) {
+            fprintf(stderr, "ERROR: sfs_defrag should finish a pass over files removed part way\n");
+            error_count++;
+        }
+        sfs_remove("MOVE1");
+        sfs_remove("MOVE2");
+    }
+
+    //-------- The following part tests sfs_fsck
+
+    printf("Tests sfs_fsck\n");
+
+    sfs_snapshot("FSCKSNAP");
+    if (sfs_fsck(0) != 0) {
+        fprintf(stderr, "ERROR: sfs_fsck found problems on a consistent volume\n");
+        error_count++;
+    }
+
+    // Damage a volume each way sfs_fsck knows of, and have it repaired
+    {
+        static const char *damage[] = {"a leaked block", "a block allocated twice",
+                                       "cross-linked files", "a cycle",
+                                       "a size past the chain"};
+        static char block[3 * 2048];
+        unsigned short raw[2], other[2];
+        unsigned int size = 5 * 2048;
+        unsigned char bits;
+        int a, b, last, slot, status;
+        sfs_t *vol;
+
+        for (k = 0; k < 5; k++) {
+            vol = sfs_mount("fsck.sfs", SFS_FORMAT);
+            for (i = 0; i < 2; i++) {
+                memset(block, 'A' + i, sizeof(block));
+                tmp = sfs_fopen_r(vol, i ? "B" : "A");
+                sfs_fwrite_r(vol, tmp, block, sizeof(block));
+                sfs_fclose_r(vol, tmp);
+            }
+            sfs_unmount(vol);
+
+            slot = img_lookup("fsck.sfs", "A", &a);
+            last = a;
+            for (i = 0; slot >= 0 && i < 3; i++) {
+                img_fat("fsck.sfs", last, raw);
+                if (raw[1] == IMG_END)
+                    break;
+                last = raw[1] - 1;
+            }
+            if (slot < 0 || img_lookup("fsck.sfs", "B", &b) < 0 || i != 2) {
+                fprintf(stderr, "ERROR: files on a new volume aren't laid out as expected\n");
+                error_count++;
+                break;
+            }
+
+            switch (k) {
+            case 0:     // a data block marked used that nothing holds
+                img_read("fsck.sfs", IMG_FREE_LIST * IMG_BLOCK + 2000 / 8, &bits, 1);
+                bits |= 1;
+                img_write("fsck.sfs", IMG_FREE_LIST * IMG_BLOCK + 2000 / 8, &bits, 1);
+                break;
+            case 1:     // B's first block is A's as well
+                img_fat("fsck.sfs", a, other);
+                img_fat("fsck.sfs", b, raw);
+                raw[0] = (raw[0] & 0xF000) | (other[0] & 0xFFF);
+                img_write("fsck.sfs", IMG_FAT * IMG_BLOCK + 4L * b, raw, sizeof(raw));
+                break;
+            case 2:     // A's chain runs on into B's
+            case 3:     // A's chain runs back to its start
+                raw[1] = (k == 2 ? b : a) + 1;
+                img_write("fsck.sfs", IMG_FAT * IMG_BLOCK + 4L * last, raw, sizeof(raw));
+                break;
+            case 4:     // A claims more than its chain holds
+                img_write("fsck.sfs", IMG_ROOT * IMG_BLOCK + slot * IMG_ENTRY + 16,
+                          &size, sizeof(size));
+                break;
+            }
+
+            vol = sfs_mount("fsck.sfs", 0);
+            if (sfs_fsck_r(vol, 0) <= 0) {
+                fprintf(stderr, "ERROR: sfs_fsck missed %s\n", damage[k]);
+                error_count++;
+            } else if (sfs_fsck_r(vol, 1) <= 0 || sfs_fsck_r(vol, 0) != 0) {
+                fprintf(stderr, "ERROR: sfs_fsck didn't repair %s\n", damage[k]);
+                error_count++;
+            }
+            sfs_unmount(vol);
+
+            // The repair is on disk, not just in the cache
+            vol = sfs_mount("fsck.sfs", 0);
+            if (sfs_fsck_r(vol, 0) != 0) {
+                fprintf(stderr, "ERROR: the repair of %s didn't reach the disk\n", damage[k]);
+                error_count++;
+            }
+            sfs_unmount(vol);
+        }
+
+        // The tool reports what it found in its exit status: 4 for problems
+        // left, 1 for problems repaired, 0 for none, 8 if it couldn't check
+        img_read("fsck.sfs", IMG_FREE_LIST * IMG_BLOCK + 2000 / 8, &bits, 1);
+        bits |= 1;
+        img_write("fsck.sfs", IMG_FREE_LIST * IMG_BLOCK + 2000 / 8, &bits, 1);
+        {
+            static const char *runs[] = {"./sfs_fsck fsck.sfs", "./sfs_fsck -r fsck.sfs",
+                                         "./sfs_fsck fsck.sfs", "./sfs_fsck -x",
+                                         "./sfs_fsck missing.sfs"};
+            static const int want[] = {4, 1, 0, 8, 8};
+            char cmd[64];
+
+            for (i = 0; i < 5; i++) {
+                snprintf(cmd, sizeof(cmd), "%s >/dev/null 2>&1", runs[i]);
+                status = system(cmd);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != want[i]) {
+                    fprintf(stderr, "ERROR: %s should exit with %d\n", runs[i], want[i]);
+                    error_count++;
+                }
+            }
+        }
+        remove("fsck.sfs");
+    }
+
+    //-------- The following part tests the open file table
+
+    printf("Tests descriptor reuse\n");
+
+    {
+        int ids[200], first, j;
+        char path[16], got[16], *map;
+
+        // Closed descriptors are handed out again
+        first = sfs_fopen("SLAB");
+        sfs_fclose(first);
+        for (j = 0; j < 1000; j++) {
+            tmp = sfs_fopen("SLAB");
+            sfs_fclose(tmp);
+            if (tmp != first) {
+                fprintf(stderr, "ERROR: a closed file ID should be reused\n");
+                error_count++;
+                break;
+            }
+        }
+
+        // More files open at once than the table starts out with
+        sfs_mkdir("SLABS");
+        for (j = 0; j < 200; j++) {
+            sprintf(path, "SLABS/S%03d", j);
+            ids[j] = sfs_fopen(path);
+            sfs_fwrite(ids[j], path, strlen(path) + 1);
+        }
+        for (j = 0; j < 200; j++) {
+            sprintf(path, "SLABS/S%03d", j);
+            sfs_fseek(ids[j], 0);
+            if (sfs_fopen(path) != ids[j] || sfs_fread(ids[j], got, sizeof(got)) != strlen(path) + 1
+                    || strcmp(got, path) != 0) {
+                fprintf(stderr, "ERROR: files open together should keep their own IDs\n");
+                error_count++;
+                break;
+            }
+        }
+        for (j = 0; j < 200; j++) {
+            sprintf(path, "SLABS/S%03d", j);
+            sfs_fclose(ids[j]);
+            sfs_remove(path);
+        }
+        sfs_remove("SLABS");
+
+        // A mapping keeps working after its file is closed, and writes
+        // back to that file even once its ID is handed to another
+        tmp = sfs_fopen("SLAB");
+        sfs_fwrite(tmp, "0123456789", 10);
+        map = sfs_mmap(tmp, 0, 10, SFS_MAP_READ | SFS_MAP_WRITE);
+        sfs_fclose(tmp);
+        if (sfs_remove("SLAB") != -1) {
+            fprintf(stderr, "ERROR: a mapped file should not be removed\n");
+            error_count++;
+        }
+        first = sfs_fopen("OTHER");
+        sfs_fwrite(first, "other", 6);
+        if (map == NULL || first != tmp) {
+            fprintf(stderr, "ERROR: sfs_mmap failed, or a closed file's ID wasn't reused\n");
+            error_count++;
+        }
+        else {
+            memcpy(map, "MAPPED", 6);
+            sfs_munmap(map);
+            sfs_fseek(first, 0);
+            if (sfs_fread(first, got, sizeof(got)) != 6 || strcmp(got, "other") != 0) {
+                fprintf(stderr, "ERROR: a mapping should not write back to whatever reuses its ID\n");
+                error_count++;
+            }
+            tmp = sfs_fopen("SLAB");
+            memset(got, 0, sizeof(got));
+            if (sfs_fread(tmp, got, sizeof(got)) != 10 || strcmp(got, "MAPPED6789") != 0) {
+                fprintf(stderr, "ERROR: a mapping should write back after its file is closed\n");
+                error_count++;
+            }
+            sfs_fclose(tmp);
+        }
+        if (sfs_remove("OTHER") != -1) {
+            fprintf(stderr, "ERROR: an open file should not be removed\n");
+            error_count++;
+        }
+        sfs_fclose(first);
+        if (sfs_remove("OTHER") != 0 || sfs_remove("SLAB") != 0) {
+            fprintf(stderr, "ERROR: closed and unmapped files should be removed\n");
+            error_count++;
+        }
+    }
+
+    //-------- The following part tests sparse files
+
+    printf("Tests sparse files\n");
+
+    {
+        char got[8];
+        int before = sfs_free_blocks();
+
+        // Twice what the disk holds, so the gap can't take blocks
+        tmp = sfs_fopen("SPARSE");
+        sfs_fseek(tmp, 8000000);
+        if (sfs_fwrite(tmp, "end", 3) != 3 || sfs_fsize(tmp) != 8000003) {
+            fprintf(stderr, "ERROR: writing past the end should leave a hole\n");
+            error_count++;
+        }
+        sfs_fseek(tmp, 1000001);
+        sfs_fwrite(tmp, "mid", 3);
+
+        // The first block, which the file spills into from its directory
+        // entry, and the two written
+        if (sfs_free_blocks() != before - 3) {
+            fprintf(stderr, "ERROR: a sparse file should only take blocks for its data\n");
+            error_count++;
+        }
+
+        memset(got, 1, sizeof(got));
+        sfs_fseek(tmp, 1000000);
+        if (sfs_fread(tmp, got, 5) != 5 || got[0] != 0 || memcmp(got + 1, "mid", 3) != 0
+                || got[4] != 0) {
+            fprintf(stderr, "ERROR: a hole should read as zeros around written data\n");
+            error_count++;
+        }
+        sfs_fseek(tmp, 7999999);
+        if (sfs_fread(tmp, got, 8) != 4 || got[0] != 0 || memcmp(got + 1, "end", 3) != 0) {
+            fprintf(stderr, "ERROR: data after a hole should read back\n");
+            error_count++;
+        }
+        if (sfs_fsck(0) != 0) {
+            fprintf(stderr, "ERROR: sfs_fsck found problems in a sparse file\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        sfs_remove("SPARSE");
+    }
+
+    //-------- The following part tests sfs_fallocate and sfs_ftruncate
+
+    printf("Tests sfs_fallocate and sfs_ftruncate\n");
+
+    {
+        static char got[20000];
+        unsigned short raw[2];
+        int free_before, first, k, run, gaps, kept;
+
+        // Free space starts with single block gaps, so the 10 blocks
+        // reserved have to be found as a run past them
+        mksfs(1);
+        gaps = sfs_fopen("GAPS");
+        kept = sfs_fopen("KEPT");
+        memset(got, 'g', sizeof(got));
+        for (i = 0; i < 12; i++) {
+            sfs_fwrite(gaps, got, 2048);
+            sfs_fwrite(kept, got, 2048);
+        }
+        sfs_fclose(gaps);
+        sfs_fclose(kept);
+        sfs_remove("GAPS");
+        free_before = sfs_free_blocks();
+        tmp = sfs_fopen("RESERVED");
+        if (sfs_fallocate(tmp, 0, 20000) != 0 || sfs_fsize(tmp) != 20000) {
+            fprintf(stderr, "ERROR: sfs_fallocate should grow the file\n");
+            error_count++;
+        }
+        if (sfs_free_blocks() != free_before - 10) {
+            fprintf(stderr, "ERROR: sfs_fallocate should reserve 10 blocks, not %d\n",
+                    free_before - sfs_free_blocks());
+            error_count++;
+        }
+        memset(got, 1, sizeof(got));
+        if (sfs_fread(tmp, got, sizeof(got)) != sizeof(got) || got[0] != 0
+                || memcmp(got, got + 1, sizeof(got) - 1) != 0) {
+            fprintf(stderr, "ERROR: reserved space should read as zeros\n");
+            error_count++;
+        }
+
+        // Writing the reserved range takes no more blocks
+        memset(got, 'r', sizeof(got));
+        sfs_fseek(tmp, 0);
+        sfs_fwrite(tmp, got, sizeof(got));
+        if (sfs_free_blocks() != free_before - 10) {
+            fprintf(stderr, "ERROR: writing reserved space should not allocate\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        mksfs(0);
+        k = img_lookup("my.sfs", "RESERVED", &first) != -1 ? first : -1;
+        for (i = 0, run = 0; i < 10 && k >= 0; i++) {
+            img_fat("my.sfs", k, raw);
+            if (i == 0)
+                run = raw[0];
+            if (raw[0] == IMG_END || raw[0] != run + i)
+                break;
+            k = raw[1] - 1;
+        }
+        if (i != 10) {
+            fprintf(stderr, "ERROR: reserved blocks should be contiguous\n");
+            error_count++;
+        }
+
+        tmp = sfs_fopen("RESERVED");
+        sfs_fseek(tmp, 0);
+        sfs_fwrite(tmp, test_str, strlen(test_str));
+        if (sfs_ftruncate(tmp, 10) != 0 || sfs_fsize(tmp) != 10
+                || sfs_ftruncate(tmp, 4000) != 0 || sfs_fsize(tmp) != 4000) {
+            fprintf(stderr, "ERROR: sfs_ftruncate should set the size\n");
+            error_count++;
+        }
+        memset(got, 1, sizeof(got));
+        sfs_fseek(tmp, 0);
+        if (sfs_fread(tmp, got, sizeof(got)) != 4000 || memcmp(got, test_str, 10) != 0
+                || got[10] != 0 || memcmp(got + 10, got + 11, 4000 - 11) != 0) {
+            fprintf(stderr, "ERROR: a truncated file should read zeros past the old end\n");
+            error_count++;
+        }
+        if (sfs_ftruncate(tmp, -1) != -1 || sfs_fallocate(tmp, 0, 0) != -1) {
+            fprintf(stderr, "ERROR: bad sizes should be refused\n");
+            error_count++;
+        }
+        if (sfs_fsck(0) != 0) {
+            fprintf(stderr, "ERROR: sfs_fsck found problems after sfs_ftruncate\n");
+            error_count++;
+        }
+
+        // Clearing the tail of a shared block needs a copy of it; with no
+        // room for one the truncate fails and the file is left alone
+        sfs_clone("RESERVED", "SHARED");
+        kept = sfs_fopen("FILLER");
+        memset(fixedbuf, 'f', sizeof(fixedbuf));
+        while (sfs_free_blocks() > 0
+                && sfs_fwrite(kept, fixedbuf, sizeof(fixedbuf)) == sizeof(fixedbuf))
+            ;
+        if (sfs_ftruncate(tmp, 2000) != -1 || sfs_fsize(tmp) != 4000) {
+            fprintf(stderr, "ERROR: sfs_ftruncate should fail when the last block can't be cleared\n");
+            error_count++;
+        }
+        sfs_fclose(kept);
+        sfs_remove("FILLER");
+        sfs_remove("SHARED");
+        if (sfs_ftruncate(tmp, 2000) != 0 || sfs_fsize(tmp) != 2000 || sfs_fsck(0) != 0) {
+            fprintf(stderr, "ERROR: sfs_ftruncate should work again once there is room\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        sfs_remove("RESERVED");
+        sfs_remove("KEPT");
+    }
+
+    //-------- The following part tests mksfs_opts(SFS_LOG)
+
+    printf("Tests mksfs_opts(SFS_LOG)\n");
+
+    if (mksfs_opts(1, SFS_LOG) != 0 || mksfs_opts(1, SFS_LOG | SFS_DEDUP) != -1) {
+        fprintf(stderr, "ERROR: formatting a log volume\n");
+        error_count++;
+    }
+    mksfs_opts(1, SFS_LOG);
+    {
+        static char shadow[64 * 2048], back[64 * 2048];
+        unsigned int used[64];
+        unsigned short raw[2];
+        int fill, at, where[64], clean;
+
+        // Most of the disk is taken, so the log has to be cleaned as it wraps
+        fill = sfs_fopen("FILL");
+        memset(back, 'f', sizeof(back));
+        for (i = 0; i < 27; i++)
+            sfs_fwrite(fill, back, sizeof(back));
+        sfs_fclose(fill);
+
+        for (i = 0; i < sizeof(shadow); i++)
+            shadow[i] = 'a' + i % 26;
+        tmp = sfs_fopen("LOGGED");
+        sfs_fwrite(tmp, shadow, sizeof(shadow));
+
+        // Writes scattered over the file reach the disk one after the other,
+        // to blocks 7, 30, 53 and 12
+        for (i = 0; i < 4; i++) {
+            at = (i * 23 + 7) % 64 * 2048;
+            shadow[at] = 'A' + i;
+            sfs_fseek(tmp, at);
+            sfs_fwrite(tmp, shadow + at, 1);
+        }
+        mksfs(0);
+        j = img_lookup("my.sfs", "LOGGED", &k);
+        for (i = 0; j >= 0 && i < 64; i++) {
+            img_fat("my.sfs", k, raw);
+            where[i] = (raw[0] & 0xFFF) - 1;
+            k = raw[1] - 1;
+        }
+        if (j < 0 || where[30] != where[7] + 1 || where[53] != where[30] + 1
+                || where[12] != where[53] + 1) {
+            fprintf(stderr, "ERROR: a log volume should write scattered blocks one after the other\n");
+            error_count++;
+        }
+
+        tmp = sfs_fopen("LOGGED");
+        for (i = 0; i < 5000; i++) {
+            int len = 1 + rand() % 100;
+            at = rand() % (sizeof(shadow) - 100);
+            for (j = 0; j < len; j++)
+                shadow[at + j] = rand();
+            sfs_fseek(tmp, at);
+            if (sfs_fwrite(tmp, shadow + at, len) != len) {
+                fprintf(stderr, "ERROR: small write %d to a log volume failed\n", i);
+                error_count++;
+                break;
+            }
+        }
+        mksfs(0);
+        tmp = sfs_fopen("LOGGED");
+        if (sfs_fread(tmp, back, sizeof(back)) != sizeof(back)
+                || memcmp(back, shadow, sizeof(back)) != 0) {
+            fprintf(stderr, "ERROR: a log volume should read back what was written\n");
+            error_count++;
+        }
+
+        // The free space is 8 segments' worth. The cleaner keeps 4 clean,
+        // less one the log may have just moved on to; without it the
+        // writes leave the space scattered over all of them.
+        img_read("my.sfs", IMG_FREE_LIST * IMG_BLOCK, used, sizeof(used));
+        for (i = clean = 0; i < 64; i++)
+            clean += used[i] == 0;
+        if (clean < 3) {
+            fprintf(stderr, "ERROR: the log cleaner should keep segments free, found %d\n", clean);
+            error_count++;
+        }
+        if (sfs_fsck(0) != 0) {
+            fprintf(stderr, "ERROR: sfs_fsck found problems on a log volume\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        sfs_remove("LOGGED");
+        sfs_remove("FILL");
+    }
+
+    //-------- The following part tests SFS_DIRECT
+
+    printf("Tests SFS_DIRECT\n");
+
+    {
+        static char data[30 * 2048], back[30 * 2048];
+        sfs_t *vol;
+        int fd, pass, host = 0, probe;
+
+        for (i = 0; i < sizeof(data); i++)
+            data[i] = i * 13 + i / 2048;
+
+        // Written with the host's page cache bypassed, then read back
+        // both without it and through it
+        for (pass = 0; pass < 3; pass++) {
+            vol = sfs_mount("vol_b.sfs", pass == 0 ? SFS_FORMAT | SFS_DIRECT
+                                       : pass == 1 ? SFS_DIRECT : 0);
+            fd = vol ? sfs_fopen_r(vol, "DIRECT") : -1;
+
+            // It only takes effect where the host can open the image that way
+            if (pass == 0 && (probe = open("vol_b.sfs", O_RDWR | O_DIRECT)) >= 0) {
+                host = 1;
+                close(probe);
+            }
+            if (sfs_direct_r(vol) != (pass < 2 && host)) {
+                fprintf(stderr, "ERROR: sfs_direct should tell whether SFS_DIRECT took effect (pass %d)\n", pass);
+                error_count++;
+            }
+            if (pass == 0 && sfs_fwrite_r(vol, fd, data, sizeof(data)) != sizeof(data)) {
+                fprintf(stderr, "ERROR: writing with SFS_DIRECT failed\n");
+                error_count++;
+            }
+            memset(back, 0, sizeof(back));
+            if (fd < 0 || sfs_fread_r(vol, fd, back, sizeof(back)) != sizeof(back)
+                    || memcmp(data, back, sizeof(back)) != 0) {
+                fprintf(stderr, "ERROR: a volume written with SFS_DIRECT should read back (pass %d)\n", pass);
+                error_count++;
+            }
+            sfs_unmount(vol);
+        }
+    }
+
+    //-------- The following part tests warm restarts
+
+    printf("Tests warm restarts\n");
+
+    {
+        static char data[20 * 2048], back[20 * 2048];
+        FILE *img;
+        int hot = 0;
+
+        for (i = 0; i < sizeof(data); i++)
+            data[i] = i * 3 + i / 2048;
+        mksfs(1);
+        tmp = sfs_fopen("WARM");
+        sfs_fwrite(tmp, data, sizeof(data));
+        sfs_fclose(tmp);
+
+        // The blocks just written are still cached, so unmounting lists them
+        mksfs(0);
+        img = fopen("my.sfs", "rb");
+        if (img == NULL || fseek(img, 16 * sizeof(int), SEEK_SET) != 0
+                || fread(&hot, sizeof(hot), 1, img) != 1 || hot <= 0) {
+            fprintf(stderr, "ERROR: a clean unmount should list the cached blocks\n");
+            error_count++;
+        }
+        if (img != NULL)
+            fclose(img);
+
+        // Blocks written while they are being read back keep what was written
+        tmp = sfs_fopen("WARM");
+        memcpy(data + 2048, "rewritten", 9);
+        sfs_fseek(tmp, 2048);
+        sfs_fwrite(tmp, data + 2048, 9);
+        sfs_fseek(tmp, 0);
+        if (sfs_fread(tmp, back, sizeof(back)) != sizeof(back)
+                || memcmp(data, back, sizeof(back)) != 0) {
+            fprintf(stderr, "ERROR: a file read after a warm restart should match what was written\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        mksfs(0);
+
+        // Once the blocks have been read back, misses are served from them
+        usleep(200000);
+        tmp = sfs_fopen("WARM");
+        if (sfs_fread(tmp, back, sizeof(back)) != sizeof(back)
+                || memcmp(data, back, sizeof(back)) != 0) {
+            fprintf(stderr, "ERROR: a file read after a second warm restart should match what was written\n");
+            error_count++;
+        }
+        sfs_fclose(tmp);
+        if (sfs_warm_hits() <= 0) {
+            fprintf(stderr, "ERROR: a read after a warm restart should be served from the blocks read back\n");
+            error_count++;
+        }
+        sfs_remove("WARM");
+    }
+
+    //-------- The following part tests sfs_mount with several volumes
+
+    printf("Tests sfs_mount\n");
+
+    {
+        char *names[2] = {"vol_a.sfs", "vol_b.sfs"};
+        char *text[2] = {"first", "second"};
+        sfs_t *vol[2];
+        char got[16];
+        int v, fd, zero = 0;
+
+        // Both volumes are open at once while they are written
+        for (v = 0; v < 2; v++) {
+            vol[v] = sfs_mount(names[v], SFS_FORMAT);
+            if (vol[v] == NULL) {
+                fprintf(stderr, "ERROR: sfs_mount failed to format %s\n", names[v]);
+                error_count++;
+                continue;
+            }
+            fd = sfs_fopen_r(vol[v], "SAME");
+            sfs_fwrite_r(vol[v], fd, text[v], strlen(text[v]) + 1);
+        }
+        for (v = 0; v < 2; v++)
+            sfs_unmount(vol[v]);
+
+        for (v = 0; v < 2; v++) {
+            vol[v] = sfs_mount(names[v], 0);
+            fd = vol[v] ? sfs_fopen_r(vol[v], "SAME") : -1;
+            if (fd < 0 || sfs_fread_r(vol[v], fd, got, sizeof(got)) != strlen(text[v]) + 1
+                    || strcmp(got, text[v]) != 0) {
+                fprintf(stderr, "ERROR: volumes mounted together should keep their own files\n");
+                error_count++;
+            }
+            sfs_unmount(vol[v]);
+        }
+
+        // The volume opened by mksfs is untouched by the others
+        fd = sfs_fopen("SAME");
+        if (sfs_fread(fd, got, 1) != 0) {
+            fprintf(stderr, "ERROR: sfs_mount should not change the default volume\n");
+            error_count++;
+        }
+        sfs_fclose(fd);
+        sfs_remove("SAME");
+
+        // An image without the current format's magic is refused
+        img_write("vol_b.sfs", 8 * sizeof(int), &zero, sizeof(zero));
+        vol[1] = sfs_mount("vol_b.sfs", 0);
+        if (vol[1] != NULL) {
+            fprintf(stderr, "ERROR: sfs_mount should refuse an image of another format\n");
+            error_count++;
+            sfs_unmount(vol[1]);
+        }
+    }
+
+    //-------- The following part tests sfs_mount_striped
+
+    printf("Tests sfs_mount_striped\n");
+
+    {
+        const char *members[3] = {"stripe0.sfs", "stripe1.sfs", "stripe2.sfs"};
+        static char data[40 * 2048], back[40 * 2048];
+        sfs_t *vol;
+        int fd;
+
+        for (i = 0; i < sizeof(data); i++)
+            data[i] = i * 7 + i / 2048;
+
+        vol = sfs_mount_striped(members, 3, 4, SFS_FORMAT);
+        fd = vol ? sfs_fopen_r(vol, "STRIPED") : -1;
+        if (fd < 0 || sfs_fwrite_r(vol, fd, data, sizeof(data)) != sizeof(data)) {
+            fprintf(stderr, "ERROR: writing to a striped volume failed\n");
+            error_count++;
+        }
+        sfs_unmount(vol);
+
+        // Read back in one call, so whole runs of blocks go to the members at once
+        vol = sfs_mount_striped(members, 3, 4, 0);
+        fd = vol ? sfs_fopen_r(vol, "STRIPED") : -1;
+        if (fd < 0 || sfs_fread_r(vol, fd, back, sizeof(back)) != sizeof(back)
+                || memcmp(data, back, sizeof(data)) != 0) {
+            fprintf(stderr, "ERROR: a striped volume should read back what was written\n");
+            error_count++;
+        }
+        if (vol && sfs_fsck_r(vol, 0) != 0) {
+            fprintf(stderr, "ERROR: sfs_fsck found problems on a striped volume\n");
+            error_count++;
+        }
+        sfs_unmount(vol);
+    }
+
+    //-------- The following part tests giving freed blocks back to the host
+
+    printf("Tests discarding freed blocks\n");
+
+    {
+        static char junk[500000];
+        struct stat st;
+        long before;
+        sfs_t *vol;
+        int async, fd;
+
+        memset(junk, 'x', sizeof(junk));
+        for (async = 0; async < 2; async++) {
+            vol = sfs_mount("vol_a.sfs", SFS_FORMAT);
+            fd = vol ? sfs_fopen_r(vol, "JUNK") : -1;
+            sfs_fwrite_r(vol, fd, junk, sizeof(junk));
+            sfs_unmount(vol);
+
+            vol = sfs_mount("vol_a.sfs", async ? SFS_DISCARD_ASYNC : 0);
+            stat("vol_a.sfs", &st);
+            before = st.st_blocks;
+
+            // Asynchronous discards are all done by the time it unmounts
+            sfs_remove_r(vol, "JUNK");
+            sfs_unmount(vol);
+            stat("vol_a.sfs", &st);
+            if (fd < 0 || st.st_blocks > before - (long) sizeof(junk) / 512 * 3 / 4) {
+                fprintf(stderr, "ERROR: removing a file should free its space on the host\n");
+                error_count++;
+            }
+        }
+
+        // Reading blocks still waiting to be discarded doesn't keep them
+        // from being given back
+        {
+            disk_t *d = disk_create("discard.disk", 2048, 300);
+            int n = sizeof(junk) / 2048;
+
+            if (d != NULL) {
+                disk_write(d, 0, n, junk);
+                disk_sync(d);
+                stat("discard.disk", &st);
+                before = st.st_blocks;
+                disk_set_async_discard(d, 1);
+                for (i = 0; i < n; i += 2)
+                    disk_discard(d, i, 2);
+                for (i = 0; i < n; i++)
+                    disk_read(d, i, 1, junk);
+            }
+            disk_close(d);
+            stat("discard.disk", &st);
+            if (d == NULL || st.st_blocks > before - (long) n * 2048 / 512 * 3 / 4) {
+                fprintf(stderr, "ERROR: reading blocks being discarded should not keep their space\n");
+                error_count++;
+            }
+            remove("discard.disk");
+        }
+    }
+
+    //-------- The following part tests write-back errors
+
+    printf("Tests write-back errors\n");
+
+    {
+        static char data[10 * 2048];
+        struct rlimit lim, old;
+        sfs_t *vol;
+        int fd, failed, clean;
+
+        vol = sfs_mount("vol_a.sfs", SFS_FORMAT);
+        fd = vol ? sfs_fopen_r(vol, "KEPT") : -1;
+        sfs_fwrite_r(vol, fd, data, sizeof(data));
+        clean = sfs_unmount(vol) == 0;
+
+        // The host refuses writes from the first data block on, so the
+        // flusher fails; the next write and the unmount say so
+        vol = sfs_mount("vol_a.sfs", 0);
+        fd = vol ? sfs_fopen_r(vol, "LOST") : -1;
+        getrlimit(RLIMIT_FSIZE, &old);
+        lim = old;
+        lim.rlim_cur = (rlim_t) IMG_DATA * IMG_BLOCK;
+        signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &lim);
+        sfs_fwrite_r(vol, fd, data, sizeof(data));
+        usleep(200000);
+        failed = sfs_fwrite_r(vol, fd, data, sizeof(data)) == -1;
+        sfs_fwrite_r(vol, fd, data, sizeof(data));
+        if (fd < 0 || !clean || !failed || sfs_unmount(vol) != -1) {
+            fprintf(stderr, "ERROR: a failed write-back should be reported\n");
+            error_count++;
+        }
+        setrlimit(RLIMIT_FSIZE, &old);
+        signal(SIGXFSZ, SIG_DFL);
+    }
+
+    //-------- The following part tests the disk request queue
+
+    printf("Tests the disk request queue\n");
+
+    {
+        // Block 100 holds the disk while the others queue up. From there
+        // the sweep goes up to the end, wraps, and merges 10 to 12; then a
+        // read whose thread has a deadline of 0 is served ahead of it.
+        static queued_read sweep[] = {
+            {.block = 10, .deadline = -1}, {.block = 11, .deadline = -1},
+            {.block = 12, .deadline = -1}, {.block = 200, .deadline = -1},
+            {.block = 150, .deadline = -1}, {.block = 50, .deadline = -1},
+            {.block = -1}};
+        static queued_read overdue[] = {
+            {.block = 150, .deadline = -1}, {.block = 50, .deadline = 0},
+            {.block = -1}};
+        static const int sweep_want[][2] = {{100, 1}, {150, 1}, {200, 1}, {10, 3}, {50, 1}};
+        static const int overdue_want[][2] = {{100, 1}, {50, 1}, {150, 1}};
+        queued_read *reads[] = {sweep, overdue};
+        const int (*want[])[2] = {sweep_want, overdue_want};
+        int wanted[] = {5, 3};
+        char block[512];
+
+        queue_disk = disk_create("queue.disk", 512, 256);
+        disk_set_deadlines(queue_disk, 10000, 10000);
+        for (k = 0; queue_disk != NULL && k < 2; k++) {
+            queue_logged = 0;
+            disk_set_trace(queue_disk, queue_trace, reads[k]);
+            disk_read(queue_disk, 100, 1, block);
+            for (i = 0; reads[k][i].block >= 0; i++)
+                pthread_join(reads[k][i].thread, NULL);
+            disk_set_trace(queue_disk, NULL, NULL);
+
+            for (i = 0; i < wanted[k] && queue_logged == wanted[k]; i++) {
+                if (queue_log[i][0] != want[k][i][0] || queue_log[i][1] != want[k][i][1])
+                    break;
+            }
+            if (i != wanted[k] || queue_logged != wanted[k]) {
+                fprintf(stderr, "ERROR: the disk should serve %s\n", k == 0
+                        ? "requests in sweep order, merging adjacent ones"
+                        : "an overdue request first");
+                error_count++;
+            }
+        }
+        if (queue_disk == NULL) {
+            fprintf(stderr, "ERROR: cannot create a disk to test the queue on\n");
+            error_count++;
+        }
+        disk_close(queue_disk);
+        remove("queue.disk");
+    }
+
     //free(buffer);
 
     fprintf(stderr, "Test program exiting with %d errors\n", error_count);
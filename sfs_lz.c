@@ -0,0 +1,151 @@
+#include "sfs_lz.h"
+#include <string.h>
+/************************************************
+Block compressor for SFS
+
+A byte-oriented LZ77 in the style of LZ4. The stream is a series of
+sequences, each a token byte followed by literals and a back reference:
+
+    token    high nibble = literal count, low nibble = match length - 4,
+             15 in either means more length bytes follow (255 = continue)
+    literals copied verbatim
+    offset   2 bytes, little endian, distance back into the output
+
+The last sequence carries literals only and ends the stream.
+************************************************/
+
+#define MIN_MATCH 4
+#define HASH_BITS 10
+
+static unsigned int read32(const unsigned char *p){
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Append a length that didn't fit in its nibble
+static int put_length(unsigned char *dst, int *op, int cap, int len){
+    for (; len >= 255; len -= 255){
+        if (*op >= cap)
+            return -1;
+        dst[(*op)++] = 255;}
+
+    if (*op >= cap)
+        return -1;
+    dst[(*op)++] = len;
+    return 0;
+}
+
+// Emit literals followed, unless len is 0, by a match of len at offset
+static int put_sequence(unsigned char *dst, int *op, int cap,
+                        const unsigned char *lit, int nlit, int offset, int len){
+    int ml = len ? len - MIN_MATCH : 0;
+
+    if (*op >= cap)
+        return -1;
+    dst[(*op)++] = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+
+    if (nlit >= 15 && put_length(dst, op, cap, nlit - 15) == -1)
+        return -1;
+    if (*op + nlit > cap)
+        return -1;
+    memcpy(dst + *op, lit, nlit);
+    *op += nlit;
+
+    if (len == 0)
+        return 0;
+
+    if (*op + 2 > cap)
+        return -1;
+    dst[(*op)++] = offset & 0xFF;
+    dst[(*op)++] = offset >> 8;
+    if (ml >= 15 && put_length(dst, op, cap, ml - 15) == -1)
+        return -1;
+    return 0;
+}
+
+// Compress n bytes of src into at most cap bytes of dst. Returns the
+// compressed length, or -1 if it would not fit.
+int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap){
+    unsigned short table[1 << HASH_BITS];   // last position + 1, 0 = none
+    int ip = 0, anchor = 0, op = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (ip + MIN_MATCH <= n){
+        unsigned int seq = read32(src + ip);
+        int h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        int ref = table[h] - 1;
+
+        table[h] = ip + 1;
+        if (ref < 0 || ip - ref > 0xFFFF || read32(src + ref) != seq){
+            ip++;
+            continue;}
+
+        int len = MIN_MATCH;
+        while (ip + len < n && src[ref + len] == src[ip + len])
+            len++;
+
+        if (put_sequence(dst, &op, cap, src + anchor, ip - anchor, ip - ref, len) == -1)
+            return -1;
+        ip += len;
+        anchor = ip;
+    }
+
+    if (put_sequence(dst, &op, cap, src + anchor, n - anchor, 0, 0) == -1)
+        return -1;
+    return op;
+}
+
+// Read a length continued past its nibble
+static int get_length(const unsigned char *src, int *ip, int n, int *len){
+    int b;
+
+    do {
+        if (*ip >= n)
+            return -1;
+        b = src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Expand n bytes of src into at most cap bytes of dst. Returns the
+// decompressed length, or -1 if the stream is malformed.
+int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap){
+    int ip = 0, op = 0;
+
+    while (ip < n){
+        int token = src[ip++];
+        int nlit = token >> 4;
+
+        if (nlit == 15 && get_length(src, &ip, n, &nlit) == -1)
+            return -1;
+        if (ip + nlit > n || op + nlit > cap)
+            return -1;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == n)
+            break;  // literals-only sequence ends the stream
+
+        if (ip + 2 > n)
+            return -1;
+        int offset = src[ip] | src[ip + 1] << 8;
+        int len = (token & 15) + MIN_MATCH;
+        ip += 2;
+
+        if ((token & 15) == 15 && get_length(src, &ip, n, &len) == -1)
+            return -1;
+        if (offset == 0 || offset > op || op + len > cap)
+            return -1;
+
+        // Byte at a time, since the match may overlap its own output
+        int k;
+        for (k = 0; k < len; k++)
+            dst[op + k] = dst[op - offset + k];
+        op += len;
+    }
+    return op;
+}
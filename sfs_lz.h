@@ -0,0 +1,5 @@
+#ifndef _SFS_LZ_H_
+#define _SFS_LZ_H_
+int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap);
+int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap);
+#endif
@@ -0,0 +1,554 @@
+/* File system daemon: owns one volume and serves it to local processes
+ * over a Unix domain socket, so they all share its cache and allocator.
+ *
+ *   ./sfsd [-f] [-s socket] image
+ *
+ * With -f the image is formatted first. Clients use the library in
+ * sfs_client.c; the protocol is described in sfsd.h. The daemon exits,
+ * writing everything back, on SIGINT or SIGTERM.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "sfs_api.h"
+#include "sfsd.h"
+
+/* Most clients connected at once */
+#define MAX_CLIENTS 256
+
+/* Largest request accepted, payload included */
+#define MAX_REQUEST (16 << 20)
+
+/* A file a client has open. Each client has its own read and write
+ * pointers, so reads and writes go to the volume with explicit offsets. */
+typedef struct open_file {
+    int fd;                 /* the volume's file ID, -1 if the slot is free */
+    unsigned int read_ptr;
+    unsigned int write_ptr;
+} open_file;
+
+typedef struct client {
+    int sock;
+    sfsd_ring *ring;
+    open_file *files;
+    int nfiles;
+    char *in;               /* received, not yet handled */
+    int in_len, in_cap;
+    char *out;              /* replies not yet sent */
+    int out_len, out_cap;
+    int out_sent;           /* bytes at the start of out already sent */
+} client;
+
+static sfs_t *vol;
+static char *image;
+static client *clients[MAX_CLIENTS];
+static int nclients;
+
+/* Opens of each of the volume's file IDs across all clients. The volume
+ * hands out one ID per file, so it is closed only when the last client
+ * that opened the file closes it. */
+static int *refs;
+static int nrefs;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    stop = 1;
+}
+
+/* Space for n more bytes of reply; NULL if out of memory */
+static char *out_reserve(client *c, int n)
+{
+    if (c->out_len + n > c->out_cap) {
+        int cap = c->out_cap ? c->out_cap : 4096;
+        char *out;
+
+        while (cap < c->out_len + n)
+            cap *= 2;
+        out = realloc(c->out, cap);
+        if (out == NULL)
+            return NULL;
+        c->out = out;
+        c->out_cap = cap;
+    }
+    c->out_len += n;
+    return c->out + c->out_len - n;
+}
+
+static int reply(client *c, int ret)
+{
+    sfsd_resp r = {ret, 0, 0};
+    char *p = out_reserve(c, sizeof(r));
+
+    if (p == NULL)
+        return -1;
+    memcpy(p, &r, sizeof(r));
+    return 0;
+}
+
+static open_file *get_file(client *c, int id)
+{
+    if (id < 0 || id >= c->nfiles || c->files[id].fd < 0)
+        return NULL;
+    return &c->files[id];
+}
+
+static void file_close(client *c, open_file *f)
+{
+    if (--refs[f->fd] == 0)
+        sfs_fclose_r(vol, f->fd);
+    f->fd = -1;
+}
+
+static int do_open(client *c, char *name)
+{
+    int fd = sfs_fopen_r(vol, name), id;
+
+    if (fd < 0)
+        return -1;
+
+    /* Opening a file twice gives back the same ID, as sfs_fopen does */
+    for (id = 0; id < c->nfiles; id++) {
+        if (c->files[id].fd == fd)
+            return id;
+    }
+
+    if (fd >= nrefs) {
+        int *more = realloc(refs, (fd + 1) * sizeof(int));
+        if (more == NULL)
+            return -1;
+        memset(more + nrefs, 0, (fd + 1 - nrefs) * sizeof(int));
+        refs = more;
+        nrefs = fd + 1;
+    }
+
+    for (id = 0; id < c->nfiles && c->files[id].fd >= 0; id++)
+        ;
+    if (id == c->nfiles) {
+        open_file *more = realloc(c->files, (c->nfiles + 1) * sizeof(open_file));
+        if (more == NULL)
+            return -1;
+        c->files = more;
+        c->nfiles++;
+    }
+
+    refs[fd]++;
+    c->files[id].fd = fd;
+    c->files[id].read_ptr = 0;
+    c->files[id].write_ptr = sfs_fsize_r(vol, fd);
+    return id;
+}
+
+/* Space in the client's ring for len bytes of read data, at a position
+ * where they don't wrap. Returns -1 if the ring is too full. */
+static int ring_alloc(client *c, int len, unsigned int *at)
+{
+    sfsd_ring *r = c->ring;
+    unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    unsigned int skip = 0;
+
+    if (len > SFSD_RING)
+        return -1;
+    if (r->head % SFSD_RING + len > SFSD_RING)
+        skip = SFSD_RING - r->head % SFSD_RING;
+    if (r->head - tail + skip + len > SFSD_RING)
+        return -1;
+    *at = r->head + skip;
+    return 0;
+}
+
+/* Read straight into the ring when the client's buffer is big enough to
+ * be worth it, else into the reply stream */
+static int do_read(client *c, open_file *f, int len)
+{
+    sfsd_resp r = {-1, 0, 0};
+    struct iovec iov;
+    unsigned int at;
+    int left;
+    char *p;
+
+    if (f == NULL || len < 0)
+        return reply(c, -1);
+
+    /* Nothing past the end of the file comes back, so don't make room for it */
+    left = sfs_fsize_r(vol, f->fd) - (int) f->read_ptr;
+    if (len > left)
+        len = left > 0 ? left : 0;
+
+    if (len >= SFSD_RING_MIN && ring_alloc(c, len, &at) == 0) {
+        iov.iov_base = c->ring->data + at % SFSD_RING;
+        iov.iov_len = len;
+        r.ret = sfs_freadv_r(vol, f->fd, &iov, 1, f->read_ptr);
+        if (r.ret > 0) {
+            f->read_ptr += r.ret;
+            r.ring = at;
+            __atomic_store_n(&c->ring->head, at + r.ret, __ATOMIC_RELEASE);
+        }
+        p = out_reserve(c, sizeof(r));
+        if (p == NULL)
+            return -1;
+        memcpy(p, &r, sizeof(r));
+        return 0;
+    }
+
+    p = out_reserve(c, sizeof(r) + len);
+    if (p == NULL)
+        return -1;
+    iov.iov_base = p + sizeof(r);
+    iov.iov_len = len;
+    r.ret = sfs_freadv_r(vol, f->fd, &iov, 1, f->read_ptr);
+    if (r.ret > 0) {
+        f->read_ptr += r.ret;
+        r.len = r.ret;
+    }
+    memcpy(p, &r, sizeof(r));
+    c->out_len -= len - r.len;
+    return 0;
+}
+
+/* sfs_ls_r prints the listing, so catch it in a memory file and send
+ * that back */
+static int do_ls(client *c)
+{
+    sfsd_resp r = {-1, 0, 0};
+    int mem, out, len;
+    char *p;
+
+    mem = memfd_create("sfsd-ls", 0);
+    if (mem < 0)
+        return reply(c, -1);
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    if (out < 0 || dup2(mem, STDOUT_FILENO) < 0) {
+        if (out >= 0)
+            close(out);
+        close(mem);
+        return reply(c, -1);
+    }
+    sfs_ls_r(vol);
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    len = lseek(mem, 0, SEEK_END);
+    p = len < 0 ? NULL : out_reserve(c, sizeof(r) + len);
+    if (p == NULL) {
+        close(mem);
+        return len < 0 ? reply(c, -1) : -1;
+    }
+    if (pread(mem, p + sizeof(r), len, 0) == len)
+        r.ret = r.len = len;
+    close(mem);
+    memcpy(p, &r, sizeof(r));
+    c->out_len -= len - r.len;
+    return 0;
+}
+
+static int handle(client *c, sfsd_req *q, char *payload)
+{
+    open_file *f = get_file(c, q->fd);
+    char name[SFSD_NAME];
+    struct iovec iov;
+    int i, ret = -1;
+
+    switch (q->op) {
+    case SFSD_FORMAT:
+        /* Not while any client has a file open on the old volume. The
+         * old volume has to be unmounted first, or its write-back would
+         * land on the new one; if formatting fails it is mounted again. */
+        for (i = 0; i < nrefs && refs[i] == 0; i++)
+            ;
+        if (i == nrefs) {
+            sfs_unmount(vol);
+            vol = sfs_mount(image, SFS_FORMAT | q->arg);
+            ret = vol ? 0 : -1;
+            if (vol == NULL)
+                vol = sfs_mount(image, 0);
+        }
+        break;
+
+    case SFSD_OPEN:
+    case SFSD_REMOVE:
+        if (q->len >= SFSD_NAME)
+            break;
+        memcpy(name, payload, q->len);
+        name[q->len] = '\0';
+        ret = q->op == SFSD_OPEN ? do_open(c, name) : sfs_remove_r(vol, name);
+        break;
+
+    case SFSD_CLOSE:
+        if (f) {
+            file_close(c, f);
+            ret = 0;
+        }
+        break;
+
+    case SFSD_READ:
+        return do_read(c, f, q->arg);
+
+    case SFSD_WRITE:
+        if (f == NULL)
+            break;
+        iov.iov_base = payload;
+        iov.iov_len = q->len;
+        ret = sfs_fwritev_r(vol, f->fd, &iov, 1, f->write_ptr);
+        if (ret > 0)
+            f->write_ptr += ret;
+        break;
+
+    case SFSD_SEEK:
+        if (f) {
+            f->read_ptr = f->write_ptr = q->arg;
+            ret = 0;
+        }
+        break;
+
+    case SFSD_LS:
+        return do_ls(c);
+    }
+    return reply(c, ret);
+}
+
+/* Send as much of the pending replies as the socket takes without
+ * blocking, so a client slow to read them holds up nobody else */
+static int flush(client *c)
+{
+    int n;
+
+    while (c->out_sent < c->out_len) {
+        n = write(c->sock, c->out + c->out_sent, c->out_len - c->out_sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    return 0;
+}
+
+/* Take whatever the client has sent, handle every complete request in
+ * it, and send the replies back together. While some are still waiting
+ * to go, only send; new requests wait in the socket until the client
+ * has taken the replies to the last ones. -1 drops the client. */
+static int serve(client *c)
+{
+    sfsd_req q;
+    int n, done = 0;
+
+    if (c->out_len > 0)
+        return flush(c);
+
+    if (c->in_cap - c->in_len < 65536) {
+        char *in = realloc(c->in, c->in_cap + 65536);
+        if (in == NULL)
+            return -1;
+        c->in = in;
+        c->in_cap += 65536;
+    }
+
+    n = read(c->sock, c->in + c->in_len, c->in_cap - c->in_len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (n <= 0)
+        return -1;
+    c->in_len += n;
+
+    while (c->in_len - done >= (int) sizeof(q)) {
+        memcpy(&q, c->in + done, sizeof(q));
+        if (q.len < 0 || q.len > MAX_REQUEST - (int) sizeof(q))
+            return -1;
+        if (c->in_len - done < (int) sizeof(q) + q.len) {
+            /* Make room for the rest of a request bigger than the buffer */
+            if (c->in_cap < (int) sizeof(q) + q.len) {
+                char *in;
+                memmove(c->in, c->in + done, c->in_len - done);
+                c->in_len -= done;
+                done = 0;
+                in = realloc(c->in, sizeof(q) + q.len);
+                if (in == NULL)
+                    return -1;
+                c->in = in;
+                c->in_cap = sizeof(q) + q.len;
+            }
+            break;
+        }
+        if (handle(c, &q, c->in + done + sizeof(q)) == -1)
+            return -1;
+        done += sizeof(q) + q.len;
+    }
+    memmove(c->in, c->in + done, c->in_len - done);
+    c->in_len -= done;
+
+    return flush(c);
+}
+
+/* Give a new client its ring, passing the memory's fd along */
+static client *welcome(int sock)
+{
+    client *c = calloc(1, sizeof(client));
+    sfsd_resp hello = {SFSD_RING, 0, 0};
+    char ctl[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {&hello, sizeof(hello)};
+    struct msghdr msg = {0};
+    struct cmsghdr *cm;
+    int mem, n;
+
+    if (c == NULL)
+        return NULL;
+    c->sock = sock;
+
+    mem = memfd_create("sfsd-ring", 0);
+    if (mem < 0 || ftruncate(mem, sizeof(sfsd_ring) + SFSD_RING) != 0) {
+        if (mem >= 0)
+            close(mem);
+        free(c);
+        return NULL;
+    }
+    c->ring = mmap(NULL, sizeof(sfsd_ring) + SFSD_RING, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, mem, 0);
+    if (c->ring == MAP_FAILED) {
+        close(mem);
+        free(c);
+        return NULL;
+    }
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl;
+    msg.msg_controllen = sizeof(ctl);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &mem, sizeof(int));
+
+    do
+        n = sendmsg(sock, &msg, 0);
+    while (n < 0 && errno == EINTR);
+    if (n != sizeof(hello)) {
+        munmap(c->ring, sizeof(sfsd_ring) + SFSD_RING);
+        close(mem);
+        free(c);
+        return NULL;
+    }
+    close(mem);
+    return c;
+}
+
+static void drop(client *c)
+{
+    int id;
+
+    for (id = 0; id < c->nfiles; id++) {
+        if (c->files[id].fd >= 0)
+            file_close(c, &c->files[id]);
+    }
+    munmap(c->ring, sizeof(sfsd_ring) + SFSD_RING);
+    close(c->sock);
+    free(c->files);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+int main(int argc, char **argv)
+{
+    char *path = getenv("SFSD_SOCKET");
+    struct pollfd pfd[MAX_CLIENTS + 1];
+    struct sockaddr_un addr = {0};
+    struct sigaction sa = {0};
+    int format = 0, listener, opt, i;
+
+    if (path == NULL)
+        path = SFSD_SOCKET;
+    while ((opt = getopt(argc, argv, "fs:")) != -1) {
+        if (opt == 'f')
+            format = 1;
+        else if (opt == 's')
+            path = optarg;
+        else
+            break;
+    }
+    if (opt != -1 || optind != argc - 1 || strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "usage: %s [-f] [-s socket] image\n", argv[0]);
+        return 2;
+    }
+    image = argv[optind];
+
+    vol = sfs_mount(image, format ? SFS_FORMAT : 0);
+    if (vol == NULL) {
+        fprintf(stderr, "Cannot open the file system in %s\n", image);
+        return 1;
+    }
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || listen(listener, 64) != 0) {
+        perror(path);
+        sfs_unmount(vol);
+        return 1;
+    }
+
+    /* No SA_RESTART, so a signal wakes poll */
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (!stop) {
+        pfd[0].fd = listener;
+        pfd[0].events = POLLIN;
+        for (i = 0; i < nclients; i++) {
+            pfd[i + 1].fd = clients[i]->sock;
+            pfd[i + 1].events = clients[i]->out_len > 0 ? POLLOUT : POLLIN;
+        }
+        if (poll(pfd, nclients + 1, -1) < 0)
+            continue;
+
+        for (i = nclients - 1; i >= 0; i--) {
+            if (pfd[i + 1].revents && serve(clients[i]) == -1) {
+                drop(clients[i]);
+                clients[i] = clients[--nclients];
+            }
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            int sock = accept(listener, NULL, NULL);
+            client *c;
+
+            if (sock < 0)
+                continue;
+            if (nclients == MAX_CLIENTS || (c = welcome(sock)) == NULL) {
+                close(sock);
+                continue;
+            }
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+            clients[nclients++] = c;
+        }
+    }
+
+    while (nclients > 0)
+        drop(clients[--nclients]);
+    close(listener);
+    unlink(path);
+    sfs_unmount(vol);
+    return 0;
+}
@@ -0,0 +1,64 @@
+/* Wire protocol between the sfsd daemon and the client library in
+ * sfs_client.c.
+ *
+ * A client sends requests over a Unix domain stream socket, each an
+ * sfsd_req followed by len bytes of payload (a file name, or the data of
+ * a write). Every request gets an sfsd_resp back, in order, followed by
+ * len bytes of data for a read that didn't go through the ring, or of
+ * the listing for SFSD_LS. Requests
+ * may be pipelined: a client can send several before reading the
+ * replies, and the daemon answers everything it has received in one go.
+ *
+ * On connect the daemon sends an sfsd_resp whose ret is the size of the
+ * client's read ring, with the ring's memory fd attached (SCM_RIGHTS).
+ */
+#ifndef _SFSD_H_
+#define _SFSD_H_
+
+/* Socket used when $SFSD_SOCKET isn't set */
+#define SFSD_SOCKET "sfsd.sock"
+
+/* Bytes of shared memory per client for read data, a power of two */
+#define SFSD_RING (1 << 20)
+
+/* Reads at least this long come back through the ring */
+#define SFSD_RING_MIN 4096
+
+/* Longest path a request may carry */
+#define SFSD_NAME 256
+
+enum {
+    SFSD_FORMAT = 1,    /* arg: SFS_* format options */
+    SFSD_OPEN,          /* payload: path */
+    SFSD_CLOSE,
+    SFSD_READ,          /* arg: bytes wanted */
+    SFSD_WRITE,         /* payload: data */
+    SFSD_SEEK,          /* arg: offset */
+    SFSD_REMOVE,        /* payload: path */
+    SFSD_LS             /* reply: what sfs_ls prints, as len bytes */
+};
+
+typedef struct sfsd_req {
+    int op;
+    int fd;             /* client's file ID for CLOSE, READ, WRITE, SEEK */
+    int arg;
+    int len;            /* bytes of payload following */
+} sfsd_req;
+
+typedef struct sfsd_resp {
+    int ret;            /* what the sfs_* call returned */
+    int len;            /* bytes of data following in the stream */
+    unsigned int ring;  /* ring position of read data if len is 0 and ret > 0 */
+} sfsd_resp;
+
+/* Start of the ring's shared memory. The daemon advances head past the
+ * data it places, the client advances tail past the data it has taken.
+ * Both count bytes from the start and wrap around; data starts at
+ * position % SFSD_RING of the ring's data and never wraps itself. */
+typedef struct sfsd_ring {
+    unsigned int head;
+    unsigned int tail;
+    char data[];
+} sfsd_ring;
+
+#endif